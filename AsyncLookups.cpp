@@ -0,0 +1,311 @@
+#ifndef ASYNC_LOOKUPS_CPP
+#define ASYNC_LOOKUPS_CPP
+
+#include "IndexFileHandler.cpp"
+#include "IoUring.cpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Point lookups that wait for their node reads side by side, so that one
+// thread keeps up to queueDepth reads in flight. Each lookup descends like
+// Index::SearchARecord; a node that is not in the buffer pool is read with
+// io_uring, and the lookup moves down a level when its read completes.
+// Rows read this way are added to the pool when a frame is free.
+// Lookups are started with submit() and moved on by poll() and drain().
+// A result is either collected by poll() with the tag given to submit(),
+// or passed to a callback given instead, as soon as the lookup finishes
+// (within submit() when every node it needs is in memory).
+// Like a cursor, a lookup keeps its current node latched (shared) while
+// its read is in flight, so lookups should be drained before the same
+// thread changes the index. A child is latched only if that needs no
+// waiting: a writer holding it may be waiting for a node another lookup
+// of this thread holds. A lookup that finds it taken starts again from
+// the root later. With shadow paging the published tree is held while
+// any lookup is in flight.
+// Without io_uring (an old kernel or a sandbox forbidding it) the nodes
+// are read with pread and every lookup finishes within submit().
+template <class Key = int, class Value = int> class AsyncLookups {
+public:
+  typedef function<void(const Key &, Value)> Callback;
+
+  struct Result {
+    uint64_t tag;
+    Key key;
+    Value address; // -1 (as a Value) if the key is not in the index
+  };
+
+private:
+  typedef ::IndexFileHandler<Key, Value> IndexFileHandler;
+  typedef ::NodeView<Key, Value> NodeView;
+
+  struct Lookup {
+    bool active = false;
+    bool reading = false; // its read is in flight
+    Key key;
+    uint64_t tag = 0;
+    Callback done;
+    int row = -1;      // node being read or looked at, latched
+    vector<char> node; // its bytes
+  };
+
+  IndexFileHandler *handler;
+  unique_ptr<IoUring> ring;
+  int fd = -1;
+  vector<Lookup> lookups;
+  vector<int> idle;     // slots free for a new lookup
+  vector<int> restarts; // lookups waiting to start from the root
+  vector<Result> results;
+  int active = 0;
+  int reading = 0;
+  shared_lock<shared_mutex> tree; // see IndexFileHandler::holdTree
+
+  // The slot is free again before the callback runs, which may submit
+  void finish(int slot, Value address) {
+    Lookup &lookup = lookups[slot];
+    if (lookup.row != -1) {
+      handler->unlatchNode(lookup.row, false);
+      lookup.row = -1;
+    }
+    Key key = lookup.key;
+    Callback done = move(lookup.done);
+    lookup.done = nullptr;
+    lookup.active = false;
+    idle.push_back(slot);
+    if (--active == 0 && tree.owns_lock()) {
+      tree.unlock();
+    }
+    if (done) {
+      done(key, address);
+    } else {
+      results.push_back(Result{lookup.tag, key, address});
+    }
+  }
+
+  // Latch the root and fetch it; later if the latch is taken
+  void start(int slot) {
+    Lookup &lookup = lookups[slot];
+    int root = handler->getRootRow();
+    if (!handler->tryLatchNode(root)) {
+      restarts.push_back(slot);
+      return;
+    }
+    if (handler->getRootRow() != root) {
+      handler->unlatchNode(root, false);
+      restarts.push_back(slot);
+      return;
+    }
+    lookup.row = root;
+    fetch(slot);
+  }
+
+  // Get the latched row's bytes: from the pool if it is there (and then
+  // go on at once), from the file otherwise. Stops once the lookup is
+  // finished, waiting for a read or waiting to start again.
+  void fetch(int slot) {
+    Lookup &lookup = lookups[slot];
+    while (lookup.active && !lookup.reading && lookup.row != -1) {
+      if (!handler->pool->copyIfCached(lookup.row, lookup.node.data())) {
+        INDEX_COUNT(handler->stats(), cacheMisses, 1);
+        INDEX_COUNT(handler->stats(), nodeReads, 1);
+        INDEX_COUNT(handler->stats(), bytesRead, lookup.node.size());
+        long long offset = (long long)lookup.row * lookup.node.size();
+        if (ring && ring->queueRead(fd, lookup.node.data(), lookup.node.size(),
+                                    offset, slot)) {
+          lookup.reading = true;
+          reading++;
+          return;
+        }
+        readRow(lookup.row, lookup.node.data(), lookup.node.size());
+        handler->pool->cacheRow(lookup.row, lookup.node.data());
+      }
+      step(slot);
+    }
+  }
+
+  // Look at the fetched node: finish in a leaf, or latch the child and
+  // make it the next row to fetch
+  void step(int slot) {
+    Lookup &lookup = lookups[slot];
+    NodeView node(lookup.node.data(), handler->m);
+    int count = node.count();
+    int itemCol = node.lowerBound(lookup.key);
+    if (node.nodeType() != 1 || itemCol >= count) {
+      bool found = node.nodeType() == 0 && itemCol < count &&
+                   node.key(itemCol) == lookup.key;
+      finish(slot, found ? node.address(itemCol) : static_cast<Value>(-1));
+      return;
+    }
+
+    int child = node.address(itemCol);
+    handler->unlatchNode(lookup.row, false);
+    lookup.row = -1;
+    if (!handler->tryLatchNode(child)) {
+      restarts.push_back(slot);
+      return;
+    }
+    lookup.row = child;
+  }
+
+  void readRow(int row, char *dst, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+      ssize_t n = ::pread(fd, dst + done, length - done,
+                          (off_t)row * length + done);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1) {
+        throw runtime_error("Could not read index row: " +
+                            string(strerror(errno)));
+      }
+      if (n == 0)
+        break;
+      done += n;
+    }
+    memset(dst + done, 0xff, length - done);
+  }
+
+  // Take the finished reads and move their lookups on
+  void reap() {
+    uint64_t tag;
+    int bytes;
+    while (ring && ring->nextCompletion(tag, bytes)) {
+      Lookup &lookup = lookups[tag];
+      lookup.reading = false;
+      reading--;
+      if (bytes < 0) {
+        throw runtime_error("Could not read index row: " +
+                            string(strerror(-bytes)));
+      }
+      // Past the end of the file rows read as -1 fields
+      memset(lookup.node.data() + bytes, 0xff, lookup.node.size() - bytes);
+      handler->pool->cacheRow(lookup.row, lookup.node.data());
+      step(tag);
+      fetch(tag);
+    }
+  }
+
+  void retryStarts() {
+    vector<int> waiting;
+    waiting.swap(restarts);
+    for (int slot : waiting) {
+      start(slot);
+    }
+  }
+
+public:
+  AsyncLookups(IndexFileHandler *handler, int queueDepth = 64)
+      : handler(handler), lookups(max(queueDepth, 1)) {
+    fd = ::open(handler->indexFileName, O_RDONLY);
+    if (fd == -1) {
+      throw runtime_error("Could not open index file: " +
+                          string(strerror(errno)));
+    }
+    try {
+      ring.reset(new IoUring(lookups.size()));
+    } catch (const runtime_error &) {
+      // No io_uring: read synchronously
+    }
+    for (int slot = lookups.size() - 1; slot >= 0; slot--) {
+      lookups[slot].node.resize(handler->getRowSize());
+      idle.push_back(slot);
+    }
+  }
+
+  AsyncLookups(const AsyncLookups &) = delete;
+  AsyncLookups &operator=(const AsyncLookups &) = delete;
+
+  ~AsyncLookups() {
+    try {
+      drain();
+    } catch (const exception &) {
+    }
+    ::close(fd);
+  }
+
+  // True if the reads go through io_uring
+  bool isAsync() const { return ring != nullptr; }
+
+  // Lookups started and not collected yet
+  int inFlight() const { return active; }
+
+  // Start looking up key; its result comes back from poll() with tag.
+  // False if queueDepth lookups are in flight already (poll() first).
+  bool submit(const Key &key, uint64_t tag) {
+    return begin(key, tag, nullptr);
+  }
+
+  // Start looking up key; done is called with the key and its address (or
+  // -1) from poll() or drain()
+  bool submit(const Key &key, Callback done) {
+    return begin(key, 0, move(done));
+  }
+
+  // Move the lookups in flight on and append the results not passed to a
+  // callback to done. With wait, blocks until at least one lookup
+  // finished, unless none is in flight. Returns the number appended.
+  int poll(vector<Result> &done, bool wait) {
+    advance(wait);
+    int count = results.size();
+    done.insert(done.end(), results.begin(), results.end());
+    results.clear();
+    return count;
+  }
+
+  // Run every lookup in flight to the end; the results stay for poll()
+  void drain() {
+    while (active > 0) {
+      advance(true);
+    }
+  }
+
+private:
+  void advance(bool wait) {
+    int before = active;
+    while (true) {
+      if (ring) {
+        ring->submit(wait && reading > 0 ? 1 : 0);
+      }
+      reap();
+      retryStarts();
+      if (!wait || active < before || active == 0) {
+        return;
+      }
+      if (reading == 0) {
+        // Only lookups waiting for a latch: give its writer a chance
+        this_thread::yield();
+      }
+    }
+  }
+
+  bool begin(const Key &key, uint64_t tag, Callback done) {
+    if (idle.empty()) {
+      return false;
+    }
+    if (active == 0) {
+      tree = handler->holdTree();
+    }
+    int slot = idle.back();
+    idle.pop_back();
+    Lookup &lookup = lookups[slot];
+    lookup.active = true;
+    lookup.key = key;
+    lookup.tag = tag;
+    lookup.done = move(done);
+    active++;
+    start(slot);
+    if (ring) {
+      ring->submit(0);
+    }
+    return true;
+  }
+};
+
+#endif // ASYNC_LOOKUPS_CPP
@@ -0,0 +1,664 @@
+#ifndef BUFFER_POOL_CPP
+#define BUFFER_POOL_CPP
+
+#include "IndexStats.cpp"
+#include "MappedFile.cpp"
+#include "NodeFile.cpp"
+#include "NodeLatches.cpp"
+#include "WriteAheadLog.cpp"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// Fixed number of row-sized frames caching the index file. Rows are pinned
+// while in use, evicted with the CLOCK policy and written back only when
+// dirty (on eviction or flush).
+// In memory-mapped mode there are no frames: pin() returns the row inside
+// the mapping. The flush at the end of an operation only starts writing
+// the range of rows dirtied since the last one (MS_ASYNC); flush(), sync()
+// and closing the pool wait until every row written so far is on disk.
+// With a write-ahead log each flush() is instead one atomic commit of the
+// rows changed since the previous one. Rows reach the index file only after
+// their commit is durable in the log, and a frame holding changes not yet
+// committed is never evicted, so the file is always the result of whole
+// operations once the log is replayed.
+// With deferred writes the flush at the end of each operation
+// (flushIfDue()) leaves dirty rows in memory until enough of them are dirty
+// or enough time has passed; flush(), eviction and closing the pool still
+// write them. A crash loses the operations not written back yet.
+// The pool may be used from several threads: one mutex guards the frames,
+// held for each call. It also carries the latches of the file's nodes and
+// their stats.
+class BufferPool {
+private:
+  struct Frame {
+    int row = -1;
+    int pinCount = 0;
+    bool dirty = false;
+    bool referenced = false;
+    bool uncommitted = false; // changed since the last commit to the log
+  };
+
+  mutex poolMutex; // held by every public call
+  string fileName;
+  NodeFile file;
+  int rowSize; // bytes per row
+  int capacity;
+  vector<unique_ptr<char[]>> data; // one buffer per frame
+  vector<Frame> frames;
+  unordered_map<int, int> frameOfRow;
+  int clockHand = 0;
+  int dirtyFrames = 0;
+
+  unique_ptr<MappedFile> mapping; // set in memory-mapped mode
+  int dirtyLow = INT_MAX;
+  int dirtyHigh = -1;
+  int unsyncedLow = INT_MAX; // rows msynced without waiting since
+  int unsyncedHigh = -1;     // the last durable flush
+  vector<char> pastEnd; // rows past the end of a mapping read as -1
+
+  unique_ptr<WriteAheadLog> log; // set when operations are logged
+  int groupCommit = 1;           // commits per log sync
+  bool recovered = false;        // an opener repaired what a crash left
+  bool unsyncedWrites = false;   // rows written around the log since a sync
+  static const long long checkpointBytes = 16 << 20;
+
+  int deferredRows = 0; // dirty rows left in memory at most, 0: none
+  chrono::milliseconds deferredTime{0};
+  chrono::steady_clock::time_point lastWriteBack = chrono::steady_clock::now();
+
+  NodeLatches nodeLatches; // taken by the handlers, not by the pool
+  IndexStats indexStats;
+
+  char *frameData(int frame) {
+    return data[frame].get();
+  }
+
+  // Row I/O on the index file, counted in the stats
+  void readRow(int row, char *dst) {
+    INDEX_COUNT(indexStats, nodeReads, 1);
+    INDEX_COUNT(indexStats, bytesRead, rowSize);
+    file.readRow(row, dst);
+  }
+
+  void writeRows(int row, int count, const char *src) {
+    INDEX_COUNT(indexStats, nodeWrites, count);
+    INDEX_COUNT(indexStats, bytesWritten, (uint64_t)count * rowSize);
+    file.writeRows(row, count, src);
+  }
+
+  // CLOCK sweep: unpinned frames that were used since the last pass get a
+  // second chance, the first one that was not is the victim. -1 if every
+  // frame is in use and optional is set.
+  int findVictim(bool optional = false) {
+    for (int step = 0; step < 2 * capacity; step++) {
+      int frame = clockHand;
+      clockHand = (clockHand + 1) % capacity;
+      Frame &f = frames[frame];
+      if (f.pinCount > 0 || f.uncommitted)
+        continue;
+      if (f.referenced) {
+        f.referenced = false;
+        continue;
+      }
+      return frame;
+    }
+    if (optional)
+      return -1;
+    // Uncommitted changes must stay in memory, so an operation touching
+    // more rows than there are frames gets extra ones
+    if (log) {
+      addFrame();
+      return capacity - 1;
+    }
+    throw runtime_error("All buffer pool frames are pinned");
+  }
+
+  void markClean(Frame &f) {
+    if (f.dirty) {
+      f.dirty = false;
+      dirtyFrames--;
+    }
+  }
+
+  void addFrame() {
+    data.emplace_back(new char[rowSize]);
+    frames.push_back(Frame());
+    capacity = frames.size();
+  }
+
+  void evict(int frame) {
+    Frame &f = frames[frame];
+    if (f.row == -1)
+      return;
+    // The row may not reach the file before the commit that changed it
+    if (f.dirty && log) {
+      syncLog();
+    }
+    if (f.dirty) {
+      writeRows(f.row, 1, frameData(frame));
+      markClean(f);
+    }
+    frameOfRow.erase(f.row);
+    f = Frame();
+  }
+
+  // Write every dirty frame back in row order, keeping them cached. Runs of
+  // consecutive rows go out in one write. Frames with changes not committed
+  // to the log yet stay dirty, and so do frames pinned when there is no
+  // log: writers then run side by side, and a row pinned by one may be half
+  // changed. A later flush writes it.
+  void writeBack(int skipRow = -1) {
+    lastWriteBack = chrono::steady_clock::now();
+    vector<int> toWrite;
+    for (int i = 0; i < capacity; i++) {
+      if (frames[i].row != -1 && frames[i].dirty && !frames[i].uncommitted &&
+          frames[i].row != skipRow && (log || frames[i].pinCount == 0))
+        toWrite.push_back(i);
+    }
+    if (toWrite.empty())
+      return;
+    sort(toWrite.begin(), toWrite.end(),
+         [this](int a, int b) { return frames[a].row < frames[b].row; });
+
+    vector<char> run;
+    for (size_t first = 0; first < toWrite.size();) {
+      size_t last = first + 1;
+      while (last < toWrite.size() &&
+             frames[toWrite[last]].row == frames[toWrite[last - 1]].row + 1)
+        last++;
+      if (last - first == 1) {
+        writeRows(frames[toWrite[first]].row, 1, frameData(toWrite[first]));
+      } else {
+        run.resize((last - first) * rowSize);
+        for (size_t i = first; i < last; i++) {
+          memcpy(&run[(i - first) * rowSize], frameData(toWrite[i]), rowSize);
+        }
+        writeRows(frames[toWrite[first]].row, last - first, run.data());
+      }
+      for (size_t i = first; i < last; i++) {
+        markClean(frames[toWrite[i]]);
+      }
+      first = last;
+    }
+  }
+
+  // Deferred writes wait until this many rows are dirty or the time is up
+  bool writeBackDue() const {
+    if (deferredRows == 0 || log)
+      return true;
+    int dirty = mapping ? (dirtyHigh >= 0 ? dirtyHigh - dirtyLow + 1 : 0)
+                        : dirtyFrames;
+    return dirty >= deferredRows ||
+           chrono::steady_clock::now() - lastWriteBack >= deferredTime;
+  }
+
+  // Queue the rows changed since the last commit as one log record
+  void commit() {
+    vector<int> changed;
+    for (int i = 0; i < capacity; i++) {
+      if (frames[i].uncommitted)
+        changed.push_back(i);
+    }
+    if (changed.empty())
+      return;
+    sort(changed.begin(), changed.end(),
+         [this](int a, int b) { return frames[a].row < frames[b].row; });
+
+    vector<pair<int, const char *>> rows;
+    for (int frame : changed) {
+      rows.push_back({frames[frame].row, frameData(frame)});
+      frames[frame].uncommitted = false;
+    }
+    log->commit(rows);
+  }
+
+  // Make the queued commits durable, then let their rows reach the file.
+  // Rows written around the log (appended or written through) are synced
+  // first, since the commits may refer to them.
+  void syncLog() {
+    if (log->getPendingCommits() == 0)
+      return;
+    if (unsyncedWrites) {
+      file.sync();
+      unsyncedWrites = false;
+    }
+    log->sync();
+    writeBack();
+    if (log->getSize() > checkpointBytes) {
+      checkpoint();
+    }
+  }
+
+  // Once the file itself is durable the log is no longer needed
+  void checkpoint() {
+    file.sync();
+    unsyncedWrites = false;
+    log->truncate();
+  }
+
+  // flush() and sync() with the mutex held. In memory-mapped mode only a
+  // durable flush waits for the rows to reach the disk.
+  void flushChanges(bool durable = true) {
+    if (mapping) {
+      if (dirtyHigh >= 0) {
+        INDEX_COUNT(indexStats, nodeWrites, dirtyHigh - dirtyLow + 1);
+        INDEX_COUNT(indexStats, bytesWritten,
+                    (uint64_t)(dirtyHigh - dirtyLow + 1) * rowSize);
+        unsyncedLow = min(unsyncedLow, dirtyLow);
+        unsyncedHigh = max(unsyncedHigh, dirtyHigh);
+        if (!durable) {
+          mapping->sync(dirtyLow, dirtyHigh, false);
+        }
+      }
+      if (durable && unsyncedHigh >= 0) {
+        mapping->sync(unsyncedLow, unsyncedHigh, true);
+        unsyncedLow = INT_MAX;
+        unsyncedHigh = -1;
+      }
+      dirtyLow = INT_MAX;
+      dirtyHigh = -1;
+      lastWriteBack = chrono::steady_clock::now();
+      return;
+    }
+    if (log) {
+      commit();
+      if (log->getPendingCommits() >= groupCommit) {
+        syncLog();
+      }
+      return;
+    }
+    writeBack();
+  }
+
+  // startLog() with the mutex held
+  void startLogging(int groupCommit) {
+    if (mapping) {
+      throw runtime_error("The write-ahead log needs the buffered mode");
+    }
+    if (!log) {
+      log.reset(new WriteAheadLog(WriteAheadLog::fileFor(fileName), rowSize));
+    }
+    this->groupCommit = max(groupCommit, 1);
+  }
+
+public:
+  BufferPool(const char *fileName, int rowSize, int capacity,
+             bool memoryMapped = false)
+      : fileName(fileName), file(fileName, rowSize), rowSize(rowSize),
+        capacity(max(capacity, 1)) {
+    if (memoryMapped) {
+      mapping.reset(new MappedFile(fileName, rowSize));
+      pastEnd.assign(rowSize, (char)0xff);
+      return;
+    }
+    int frameCount = this->capacity;
+    for (int i = 0; i < frameCount; i++) {
+      addFrame();
+    }
+  }
+
+  ~BufferPool() {
+    try {
+      flushChanges();
+      if (log) {
+        syncLog();
+        checkpoint();
+      }
+    } catch (const exception &) {
+    }
+  }
+
+  int getRowSize() const { return rowSize; }
+
+  bool isMemoryMapped() const { return mapping != nullptr; }
+
+  bool isLogged() const { return log != nullptr; }
+
+  NodeLatches &latches() { return nodeLatches; }
+
+  IndexStats &stats() { return indexStats; }
+
+  // A row of the mapping read without the mutex or a pin, for optimistic
+  // readers that validate what they read. nullptr in the buffered mode,
+  // where frames move, and while the mapping is being replaced.
+  char *peek(int row) const {
+    return mapping ? mapping->peekRow(row) : nullptr;
+  }
+
+  // Returns the cached bytes of a row, loading it on a miss. The frame
+  // stays resident until the matching unpin().
+  char *pin(int row) {
+    lock_guard<mutex> hold(poolMutex);
+    if (mapping) {
+      char *rowData = mapping->rowData(row);
+      return rowData != nullptr ? rowData : pastEnd.data();
+    }
+
+    auto it = frameOfRow.find(row);
+    if (it != frameOfRow.end()) {
+      INDEX_COUNT(indexStats, cacheHits, 1);
+      Frame &f = frames[it->second];
+      f.pinCount++;
+      f.referenced = true;
+      return frameData(it->second);
+    }
+
+    INDEX_COUNT(indexStats, cacheMisses, 1);
+    int frame = findVictim();
+    evict(frame);
+    readRow(row, frameData(frame));
+
+    Frame &f = frames[frame];
+    f.row = row;
+    f.pinCount = 1;
+    f.referenced = true;
+    frameOfRow[row] = frame;
+    return frameData(frame);
+  }
+
+  // Copy a row that is in memory (in a frame or the mapping) without
+  // loading it; false if it would have to be read from the file
+  bool copyIfCached(int row, char *dst) {
+    lock_guard<mutex> hold(poolMutex);
+    if (mapping) {
+      char *rowData = mapping->rowData(row);
+      memcpy(dst, rowData != nullptr ? rowData : pastEnd.data(), rowSize);
+      return true;
+    }
+    auto it = frameOfRow.find(row);
+    if (it == frameOfRow.end())
+      return false;
+    INDEX_COUNT(indexStats, cacheHits, 1);
+    frames[it->second].referenced = true;
+    memcpy(dst, frameData(it->second), rowSize);
+    return true;
+  }
+
+  // Have the kernel read count rows from firstRow ahead of a scan, so
+  // that pinning them later does not wait for the disk. Rows already in a
+  // frame are left out at either end.
+  void prefetch(int firstRow, int count) {
+    lock_guard<mutex> hold(poolMutex);
+    if (mapping) {
+      INDEX_COUNT(indexStats, readAheadRows, count);
+      mapping->prefetch(firstRow, count);
+      return;
+    }
+    int lastRow = firstRow + count - 1;
+    while (firstRow <= lastRow && frameOfRow.count(firstRow))
+      firstRow++;
+    while (lastRow >= firstRow && frameOfRow.count(lastRow))
+      lastRow--;
+    if (firstRow <= lastRow) {
+      INDEX_COUNT(indexStats, readAheadRows, lastRow - firstRow + 1);
+      file.prefetch(firstRow, lastRow - firstRow + 1);
+    }
+  }
+
+  // Keep a copy of a row read from the file around the pool (by an
+  // asynchronous lookup), if a frame is free for it. The caller holds the
+  // row's latch, so it is what the file has.
+  void cacheRow(int row, const char *src) {
+    lock_guard<mutex> hold(poolMutex);
+    if (mapping || frameOfRow.count(row))
+      return;
+    int frame = findVictim(true);
+    if (frame == -1)
+      return;
+    evict(frame);
+    memcpy(frameData(frame), src, rowSize);
+    Frame &f = frames[frame];
+    f.row = row;
+    f.referenced = true;
+    frameOfRow[row] = frame;
+  }
+
+  // A dirty unpin also moves the row's version on (see NodeLatches)
+  void unpin(int row, bool dirty) {
+    lock_guard<mutex> hold(poolMutex);
+    if (dirty) {
+      nodeLatches.changed(row);
+    }
+    if (mapping) {
+      if (dirty) {
+        if (mapping->rowData(row) == nullptr) {
+          throw runtime_error("Write past the end of the mapped index file");
+        }
+        dirtyLow = min(dirtyLow, row);
+        dirtyHigh = max(dirtyHigh, row);
+      }
+      return;
+    }
+    auto it = frameOfRow.find(row);
+    if (it == frameOfRow.end()) {
+      throw runtime_error("Unpin of a row that is not cached");
+    }
+    Frame &f = frames[it->second];
+    if (f.pinCount > 0)
+      f.pinCount--;
+    if (dirty && !f.dirty) {
+      f.dirty = true;
+      dirtyFrames++;
+    }
+    f.uncommitted = f.uncommitted || (dirty && log);
+  }
+
+  // Write every dirty frame back in row order, keeping them cached. With a
+  // log, commit the changes instead; they are synced and written back once
+  // groupCommit commits are queued.
+  void flush() {
+    lock_guard<mutex> hold(poolMutex);
+    flushChanges();
+  }
+
+  // flush() at the end of an operation: with deferred writes, only once
+  // the size or time threshold is reached. A mapping is not waited for.
+  void flushIfDue() {
+    lock_guard<mutex> hold(poolMutex);
+    if (writeBackDue()) {
+      flushChanges(false);
+    }
+  }
+
+  // Leave up to rows dirty rows in memory (in memory-mapped mode: a range
+  // of that many rows) for at most time between write-backs; 0 rows
+  // writes back at every flush. In the buffered mode at most half the
+  // frames are left dirty, since the others have to be free for reads.
+  void deferWrites(int rows, chrono::milliseconds time) {
+    lock_guard<mutex> hold(poolMutex);
+    if (log && rows > 0) {
+      throw runtime_error("Deferred writes need no write-ahead log");
+    }
+    deferredRows = mapping ? max(rows, 0) : min(max(rows, 0), max(capacity / 2, 1));
+    deferredTime = time;
+  }
+
+  // Make every flushed change durable now, whatever the group size
+  void sync() {
+    lock_guard<mutex> hold(poolMutex);
+    flushChanges();
+    if (log) {
+      syncLog();
+    } else if (!mapping) {
+      file.sync();
+    }
+  }
+
+  // Write every dirty frame back with lastRow written after all the others
+  // are durable, and make it durable too. Used to publish a copy-on-write
+  // update, where lastRow holds the root.
+  void flushBefore(int lastRow) {
+    lock_guard<mutex> hold(poolMutex);
+    writeBack(lastRow);
+    file.sync();
+    unsyncedWrites = false;
+    auto it = frameOfRow.find(lastRow);
+    if (it != frameOfRow.end() && frames[it->second].dirty) {
+      writeRows(lastRow, 1, frameData(it->second));
+      markClean(frames[it->second]);
+      file.sync();
+    }
+  }
+
+  // True for the first handler to open the file through this pool, which
+  // repairs what a crash left behind before the rows are used
+  bool claimRecovery() {
+    lock_guard<mutex> hold(poolMutex);
+    bool first = !recovered;
+    recovered = true;
+    return first;
+  }
+
+  // Replay the log left by an earlier run into the file
+  void replayLog() {
+    lock_guard<mutex> hold(poolMutex);
+    string logName = WriteAheadLog::fileFor(fileName);
+    if (::access(logName.c_str(), F_OK) != 0)
+      return;
+    WriteAheadLog previous(logName, rowSize);
+    if (previous.replay(file) > 0) {
+      file.sync();
+    }
+    previous.truncate();
+  }
+
+  // Log every flush from here on
+  void startLog(int groupCommit) {
+    lock_guard<mutex> hold(poolMutex);
+    startLogging(groupCommit);
+  }
+
+  // The file was just created: a log left next to it belongs to the file it
+  // replaced, and the new file has to be durable before commits refer to it
+  void resetLog(bool logging, int groupCommit) {
+    lock_guard<mutex> hold(poolMutex);
+    recovered = true;
+    ::unlink(WriteAheadLog::fileFor(fileName).c_str());
+    if (logging) {
+      file.sync();
+      startLogging(groupCommit);
+    }
+  }
+
+  // Write a whole row straight to the file without taking a frame, keeping
+  // a cached copy (if any) in step. Used for large sequential writes.
+  void writeThrough(int row, const char *src) {
+    lock_guard<mutex> hold(poolMutex);
+    nodeLatches.changed(row);
+    if (mapping) {
+      char *rowData = mapping->rowData(row);
+      if (rowData == nullptr) {
+        throw runtime_error("Write past the end of the mapped index file");
+      }
+      memcpy(rowData, src, rowSize);
+      dirtyLow = min(dirtyLow, row);
+      dirtyHigh = max(dirtyHigh, row);
+      return;
+    }
+    auto it = frameOfRow.find(row);
+    if (it != frameOfRow.end()) {
+      memcpy(frameData(it->second), src, rowSize);
+      markClean(frames[it->second]);
+      frames[it->second].uncommitted = false;
+    }
+    writeRows(row, 1, src);
+    unsyncedWrites = true;
+  }
+
+  // Append count rows at firstRow (the current end of the file). In
+  // memory-mapped mode the next pin() maps the larger file.
+  void appendRows(int firstRow, int count, const char *src) {
+    lock_guard<mutex> hold(poolMutex);
+    writeRows(firstRow, count, src);
+    unsyncedWrites = true;
+    if (mapping) {
+      mapping->remap();
+    }
+  }
+
+  // Drop all cached rows without writing them (the file was rewritten)
+  void discard() {
+    lock_guard<mutex> hold(poolMutex);
+    if (mapping) {
+      mapping->unmap();
+      dirtyLow = INT_MAX;
+      dirtyHigh = -1;
+      unsyncedLow = INT_MAX;
+      unsyncedHigh = -1;
+    }
+    if (log) {
+      log->discardPending();
+    }
+    frameOfRow.clear();
+    for (Frame &f : frames)
+      f = Frame();
+    clockHand = 0;
+    dirtyFrames = 0;
+  }
+
+  // One pool per index file, shared by every handler opened on it so that
+  // IndexFileHandler, Index and BTreeAddition see the same cached rows.
+  // A handler joining a live pool uses it in whatever mode it was created.
+  static shared_ptr<BufferPool> forFile(const char *fileName, int rowSize,
+                                        int capacity,
+                                        bool memoryMapped = false) {
+    lock_guard<mutex> hold(registryMutex());
+    shared_ptr<BufferPool> pool = registry()[fileName].lock();
+    if (!pool || pool->rowSize != rowSize) {
+      pool = make_shared<BufferPool>(fileName, rowSize, capacity,
+                                     memoryMapped);
+      registry()[fileName] = pool;
+    }
+    return pool;
+  }
+
+  // Drop the cached rows of the pool open on a file about to be rewritten,
+  // if there is one
+  static void discardFile(const char *fileName) {
+    shared_ptr<BufferPool> pool;
+    {
+      lock_guard<mutex> hold(registryMutex());
+      auto it = registry().find(fileName);
+      if (it != registry().end()) {
+        pool = it->second.lock();
+      }
+    }
+    if (pool) {
+      pool->discard();
+    }
+  }
+
+  // Start a fresh pool for a file that was just (re)created
+  static shared_ptr<BufferPool> create(const char *fileName, int rowSize,
+                                       int capacity,
+                                       bool memoryMapped = false) {
+    shared_ptr<BufferPool> pool =
+        make_shared<BufferPool>(fileName, rowSize, capacity, memoryMapped);
+    lock_guard<mutex> hold(registryMutex());
+    registry()[fileName] = pool;
+    return pool;
+  }
+
+private:
+  static map<string, weak_ptr<BufferPool>> &registry() {
+    static map<string, weak_ptr<BufferPool>> pools;
+    return pools;
+  }
+
+  static mutex &registryMutex() {
+    static mutex registryLock;
+    return registryLock;
+  }
+};
+
+#endif // BUFFER_POOL_CPP
@@ -0,0 +1,185 @@
+#ifndef BULK_LOADER_CPP
+#define BULK_LOADER_CPP
+
+#include "IndexFileHandler.cpp"
+#include <vector>
+
+// Builds an index bottom-up from (key, address) pairs arriving in ascending
+// key order. Leaves are filled to the fill factor. A node gets the next free
+// row when it is completed and is written once, when the node after it on
+// the same level completes, so leaves can link to their right neighbour.
+// The root is written last to row 1 where Index expects it. Only one
+// completed and one open node per level are held in memory.
+template <class Key = int, class Value = int>
+class BulkLoader : public IndexFileHandler<Key, Value> {
+public:
+    // Members of the dependent base, as in a non-template subclass
+    typedef ::IndexFileHandler<Key, Value> IndexFileHandler;
+    typedef typename IndexFileHandler::NodeView NodeView;
+    typedef typename IndexFileHandler::Entry Entry;
+    using IndexFileHandler::m;
+    using IndexFileHandler::pool;
+    using IndexFileHandler::getRowSize;
+    using IndexFileHandler::getRowCount;
+    using IndexFileHandler::getFreeListHead;
+    using IndexFileHandler::setFreeListHead;
+    using IndexFileHandler::growIndexFile;
+    using IndexFileHandler::openIndexFile;
+    using IndexFileHandler::readField;
+    using IndexFileHandler::getRecordStart;
+    using IndexFileHandler::flush;
+    using IndexFileHandler::changeTreeSize;
+    using IndexFileHandler::addToFreeList;
+
+private:
+    struct Level {
+        vector<Entry> pending; // completed, waiting for its right neighbour
+        int pendingRow = -1;
+        vector<Entry> open;
+    };
+
+    int nodeCapacity; // entries per node at the fill factor
+    int nextRow = 2;  // row 1 is kept for the root
+    vector<Level> levels;
+    bool hasLastKey = false;
+    Key lastKey;
+    long long keysAdded = 0;
+    vector<int> unusedRows; // reserved, then not needed by finish()
+
+    int nodeType(int level) const { return level == 0 ? 0 : 1; }
+
+    // Rows are taken in file order; the file grows when they run out
+    int reserveRow() {
+        if (nextRow >= getRowCount()) {
+            // Every row is taken, so the new rows must not chain onto the
+            // head left by createIndexFile
+            setFreeListHead(-1);
+            growIndexFile();
+        }
+        return nextRow++;
+    }
+
+    void writeNode(int row, int level, const vector<Entry>& entries, int nextLeaf) {
+        vector<char> buffer(getRowSize(), (char)0xff);
+        NodeView node(buffer.data(), m);
+        node.setNodeType(nodeType(level));
+        node.setLevel(level);
+        node.setCount(0);
+        node.append(entries.data(), entries.size());
+        node.setNextLeaf(nextLeaf);
+        pool->writeThrough(row, buffer.data());
+    }
+
+    // Write a completed node and hand its max to the parent level
+    void emitNode(int level, const vector<Entry>& entries, int row, int nextRowOnLevel) {
+        writeNode(row, level, entries, level == 0 ? nextRowOnLevel : -1);
+        push(level + 1, Entry{entries.back().key, static_cast<Value>(row)});
+    }
+
+    void push(int level, Entry entry) {
+        if (level == (int)levels.size()) {
+            levels.push_back(Level());
+        }
+        if ((int)levels[level].open.size() == nodeCapacity) {
+            // The open node is complete: give it a row, then write the one
+            // before it now that its right neighbour is known
+            int row = reserveRow();
+            if (levels[level].pendingRow != -1) {
+                vector<Entry> pending = levels[level].pending;
+                emitNode(level, pending, levels[level].pendingRow, row);
+            }
+            // emitNode may have grown levels, so index again
+            levels[level].pending.swap(levels[level].open);
+            levels[level].pendingRow = row;
+            levels[level].open.clear();
+        }
+        levels[level].open.push_back(entry);
+    }
+
+public:
+    BulkLoader(int m, int numberOfRecords, char* filename, double fillFactor = 1.0) {
+        openIndexFile(filename, numberOfRecords, m);
+        // Below half full every node would underflow on its first delete
+        if (fillFactor < 0.5 || fillFactor > 1) {
+            throw runtime_error("Fill factor must be in [0.5, 1]");
+        }
+        // At least three entries, so that the last two nodes of a level
+        // can be evened out to two each
+        nodeCapacity = max(min(this->m, 3), min(this->m, (int)(this->m * fillFactor)));
+
+        // Only an index straight from createIndexFile can be bulk loaded
+        if (getFreeListHead() != 1 || readField(getRecordStart(1)) != -1) {
+            throw runtime_error("Bulk load needs an empty index file");
+        }
+    }
+
+    void add(const Key& key, Value address) {
+        if (hasLastKey && !(lastKey < key)) {
+            throw runtime_error("Bulk load keys must be strictly ascending");
+        }
+        hasLastKey = true;
+        lastKey = key;
+        keysAdded++;
+        push(0, Entry{key, address});
+    }
+
+    // Write the partly filled right edge of every level, then the root, the
+    // free list head and the tree size
+    void finish() {
+        if (levels.empty()) {
+            return;
+        }
+
+        // emitNode can add a level above the last one, so the size is read
+        // again on each pass
+        for (int level = 0; level < (int)levels.size(); level++) {
+            Level& current = levels[level];
+            bool isTop = level == (int)levels.size() - 1;
+            // As in Index: internal nodes also need two children
+            int minKeys = level == 0 ? m / 2 : max(m / 2, 2);
+
+            if (isTop && current.pendingRow == -1) {
+                writeNode(1, level, current.open, -1);
+                break;
+            }
+
+            // An open node below the minimum is merged into the node before
+            // it when they fit in one, and otherwise they are evened out:
+            // more than m entries split in half leave both at least minKeys
+            if ((int)current.open.size() < minKeys) {
+                vector<Entry> both = current.pending;
+                both.insert(both.end(), current.open.begin(), current.open.end());
+                if ((int)both.size() <= m) {
+                    if (isTop) {
+                        writeNode(1, level, both, -1);
+                        unusedRows.push_back(current.pendingRow);
+                        break;
+                    }
+                    emitNode(level, both, current.pendingRow, -1);
+                    continue;
+                }
+                int leftSize = both.size() - both.size() / 2;
+                current.pending.assign(both.begin(), both.begin() + leftSize);
+                current.open.assign(both.begin() + leftSize, both.end());
+            }
+
+            vector<Entry> pending = current.pending;
+            vector<Entry> open = current.open;
+            int pendingRow = current.pendingRow;
+            int openRow = reserveRow();
+            emitNode(level, pending, pendingRow, openRow);
+            emitNode(level, open, openRow, -1);
+        }
+
+        // The rows after the tree are still chained by createIndexFile
+        setFreeListHead(nextRow < getRowCount() ? nextRow : -1);
+        for (int row : unusedRows) {
+            addToFreeList(row);
+        }
+        changeTreeSize(keysAdded, levels.size());
+        flush();
+        levels.clear();
+    }
+};
+
+#endif // BULK_LOADER_CPP
@@ -0,0 +1,45 @@
+#ifndef FIXED_KEY_CPP
+#define FIXED_KEY_CPP
+
+#include <cstring>
+#include <ostream>
+#include <string>
+using namespace std;
+
+// Fixed-width byte string key, ordered bytewise (memcmp). Shorter strings
+// are padded with zero bytes, longer ones are cut to N bytes.
+template <int N> struct FixedKey {
+  unsigned char bytes[N];
+
+  FixedKey() { memset(bytes, 0, N); }
+
+  FixedKey(const char *text) {
+    size_t length = strnlen(text, N);
+    memset(bytes, 0, N);
+    memcpy(bytes, text, length);
+  }
+
+  FixedKey(const string &text) : FixedKey(text.c_str()) {}
+
+  string str() const {
+    return string(reinterpret_cast<const char *>(bytes),
+                  strnlen(reinterpret_cast<const char *>(bytes), N));
+  }
+
+  int compare(const FixedKey &other) const {
+    return memcmp(bytes, other.bytes, N);
+  }
+
+  bool operator==(const FixedKey &other) const { return compare(other) == 0; }
+  bool operator!=(const FixedKey &other) const { return compare(other) != 0; }
+  bool operator<(const FixedKey &other) const { return compare(other) < 0; }
+  bool operator<=(const FixedKey &other) const { return compare(other) <= 0; }
+  bool operator>(const FixedKey &other) const { return compare(other) > 0; }
+  bool operator>=(const FixedKey &other) const { return compare(other) >= 0; }
+};
+
+template <int N> ostream &operator<<(ostream &out, const FixedKey<N> &key) {
+  return out << key.str();
+}
+
+#endif // FIXED_KEY_CPP
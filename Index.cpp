@@ -1,156 +1,222 @@
+#include "IndexCursor.cpp"
 #include "IndexFileHandler.cpp"
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
 #include <stdexcept>
 #include <vector>
 using namespace std;
 
-class Index {
+template <class Key = int, class Value = int> class Index {
 private:
+  typedef ::IndexFileHandler<Key, Value> IndexFileHandler;
+  typedef ::IndexNode<Key, Value> IndexNode;
+  typedef ::NodeView<Key, Value> NodeView;
+  typedef IndexEntry<Key, Value> Entry;
+
+  // Where a compaction pass is: its next leaf is the first whose separator
+  // is above after, or the first leaf when not started
+  struct ScanPosition {
+    Key after;
+    bool started = false;
+  };
+
   IndexFileHandler *handler;
+  ScanPosition compaction; // of CompactTombstones, kept between calls
 
-  // Helper: Get minimum keys required (floor(m/2))
-  int getMinKeys() const { return handler->m / 2; }
+  // Helper: Get minimum keys required (floor(m/2)). An internal node also
+  // needs two children: with m = 3 one child would meet floor(m/2), and
+  // the levels under it could then empty out without ever merging.
+  int getMinKeys(bool internal) const {
+    return internal ? max(handler->m / 2, 2) : handler->m / 2;
+  }
 
   // Helper: Find sibling info for a node using path
   struct SiblingInfo {
     IndexNode parentNode;    // The parent entry pointing to current node
-    IndexNode leftSibling;   // Entry for left sibling (key=-1 if none)
-    IndexNode rightSibling;  // Entry for right sibling (key=-1 if none)
+    IndexNode leftSibling;   // Entry for left sibling (if hasLeft)
+    IndexNode rightSibling;  // Entry for right sibling (if hasRight)
     bool hasParent;
+    bool hasLeft;
+    bool hasRight;
     
     // Constructor with all nodes initialized
-    SiblingInfo(IndexNode parent, IndexNode left, 
-                IndexNode right, bool hasP)
-        : parentNode(parent), leftSibling(left), rightSibling(right), hasParent(hasP) {}
+    SiblingInfo(IndexNode parent, IndexNode left, IndexNode right, bool hasP,
+                bool hasL, bool hasR)
+        : parentNode(parent), leftSibling(left), rightSibling(right),
+          hasParent(hasP), hasLeft(hasL), hasRight(hasR) {}
   };
 
   SiblingInfo getSiblingInfo(vector<IndexNode> &path, int childNodeIndex) {
     // Create dummy nodes for initialization (will be replaced if found)
     IndexNode dummyNode = handler->getFirstNode(0);
-    dummyNode.key = -1;
     
     if (path.empty())
-      return SiblingInfo(dummyNode, dummyNode, dummyNode, false);
+      return SiblingInfo(dummyNode, dummyNode, dummyNode, false, false, false);
 
     // Find parent entry that points to childNodeIndex
     for (int i = path.size() - 1; i >= 0; i--) {
-      if (path[i].address == childNodeIndex) {
+      if (path[i].address == static_cast<Value>(childNodeIndex)) {
         IndexNode parentNode = path[i];
         IndexNode leftSibling = dummyNode;
-        IndexNode rightSibling = path[i].getNextRecord(handler->indexFileName, handler->fileFieldSize);
+        IndexNode rightSibling = dummyNode;
+        int parentRecord = path[i].getRecordNumber(handler->getRowSize());
+        int parentSlot = handler->getSlotIndex(path[i].pos);
+        bool hasRight = parentSlot + 1 < handler->countKeys(parentRecord);
+        if (hasRight) {
+          rightSibling = path[i].getNextRecord(handler);
+        }
         
-        // Get left sibling using previous position
-        int parentRecord = path[i].getRecordNumber(handler->fileFieldSize, handler->m);
-        if (path[i].pos > handler->getFirstNode(parentRecord).pos) {
-          leftSibling = IndexNode(
-              path[i].pos - 2 * handler->fileFieldSize,
-              handler->indexFileName, handler->fileFieldSize);
+        // Get left sibling from the previous slot
+        bool hasLeft = parentSlot > 0;
+        if (hasLeft) {
+          leftSibling =
+              handler->getNodeByRecordAndIndex(parentRecord, parentSlot - 1);
         }
         
-        return SiblingInfo(parentNode, leftSibling, rightSibling, true);
+        return SiblingInfo(parentNode, leftSibling, rightSibling, true,
+                           hasLeft, hasRight);
       }
     }
-    return SiblingInfo(dummyNode, dummyNode, dummyNode, false);
+    return SiblingInfo(dummyNode, dummyNode, dummyNode, false, false, false);
+  }
+
+  // Copy-on-write: move the update onto copies of the nodes on the search
+  // path, fixing the entry positions and child addresses to match
+  void shadowPath(vector<IndexNode> &path) {
+    if (!handler->useShadowPaging) {
+      return;
+    }
+    int record = handler->shadowRow(handler->getRootRow());
+    handler->setRootRow(record);
+    for (size_t i = 0; i < path.size(); i++) {
+      path[i].pos = handler->getSlotPos(record, handler->getSlotIndex(path[i].pos));
+      if (i + 1 == path.size()) {
+        break; // the leaf entry holds a data address
+      }
+      record = shadowSibling(path[i]);
+    }
+  }
+
+  // Copy-on-write: a child about to change is copied and its entry (in a
+  // node already copied) pointed at the copy
+  int shadowSibling(IndexNode &entry) {
+    int copy = handler->shadowRow(entry.address);
+    if (static_cast<Value>(copy) != entry.address) {
+      entry.address = copy;
+      handler->writeIndexItem(entry);
+    }
+    return copy;
   }
 
   // Borrow from right sibling
   void borrowFromRight(int leafNode, SiblingInfo &siblings) {
-    IndexNode borrowNode = handler->getFirstNode(siblings.rightSibling.address);
+    INDEX_COUNT(handler->stats(), borrowsRight, 1);
+    int rightRecord = shadowSibling(siblings.rightSibling);
+    NodeView right = handler->pinNode(rightRecord);
+    NodeView current = handler->pinNode(leafNode);
 
-    // Delete from right sibling
-    handler->deleteAtNode(borrowNode);
+    // Move the right sibling's first entry to the end of the current node
+    Key borrowKey = right.key(0);
+    Value borrowAddr = right.address(0);
+    right.removeAt(0);
+    current.insertAt(current.count(), borrowKey, borrowAddr);
 
-    // Insert into current node at end
-    int currentCount = handler->countKeys(leafNode);
-    IndexNode insertNode = handler->getNodeByRecordAndIndex(leafNode, currentCount);
-    insertNode.key = borrowNode.key;
-    insertNode.address = borrowNode.address;
-    handler->writeIndexItem(insertNode);
+    handler->unpinNode(leafNode, true);
+    handler->unpinNode(rightRecord, true);
 
     // Update parent: our max changed
-    IndexNode newMaxNode = handler->getMaxKeyNode(leafNode);
-    siblings.parentNode.key = newMaxNode.key;
+    siblings.parentNode.key = borrowKey;
     handler->writeIndexItem(siblings.parentNode);
   }
 
   // Borrow from left sibling
   void borrowFromLeft(int leafNode, SiblingInfo &siblings) {
-    IndexNode borrowNode = handler->getMaxKeyNode(siblings.leftSibling.address);
-    int borrowKey = borrowNode.key;
-    int borrowAddr = borrowNode.address;
-
-    // Clear last slot in left sibling
-    borrowNode.key = -1;
-    borrowNode.address = -1;
-    handler->writeIndexItem(borrowNode);
+    INDEX_COUNT(handler->stats(), borrowsLeft, 1);
+    int leftRecord = shadowSibling(siblings.leftSibling);
+    NodeView left = handler->pinNode(leftRecord);
+    NodeView current = handler->pinNode(leafNode);
 
-    // Insert into current node at beginning
-    IndexNode leafFirstNode = handler->getFirstNode(leafNode);
-    handler->insertAtNode(leafFirstNode, borrowKey, borrowAddr);
+    // Move the left sibling's last entry to the front of the current node
+    int leftCount = left.count();
+    Key borrowKey = left.key(leftCount - 1);
+    Value borrowAddr = left.address(leftCount - 1);
+    left.removeAt(leftCount - 1);
+    current.insertAt(0, borrowKey, borrowAddr);
 
     // Update parent: left sibling's max changed
-    IndexNode newLeftMaxNode = handler->getMaxKeyNode(siblings.leftSibling.address);
-    siblings.leftSibling.key = newLeftMaxNode.key;
+    siblings.leftSibling.key = left.key(max(leftCount - 2, 0));
+
+    handler->unpinNode(leafNode, true);
+    handler->unpinNode(leftRecord, true);
     handler->writeIndexItem(siblings.leftSibling);
   }
 
-  // Merge two nodes: copies all keys from srcRecord to dstRecord
+  // Merge two nodes: copies all keys from srcRecord to dstRecord, which
+  // must be safe to change (a copy, under shadow paging); srcRecord is only
+  // read and freed.
   // Removes both parent entries and inserts a single new entry with the merged max
   // Returns the parent record number for recursive underflow handling
   int mergeNodes(int dstRecord, int srcRecord, 
                   IndexNode dstParentEntry, 
                   IndexNode srcParentEntry) {
-    int dstKeyCount = handler->countKeys(dstRecord);
-    int srcKeyCount = handler->countKeys(srcRecord);
-
+    INDEX_COUNT(handler->stats(), merges, 1);
     // Get parent record number before modifying
-    int parentRecord = dstParentEntry.getRecordNumber(handler->fileFieldSize, handler->m);
-
-    // Copy all keys from source to destination (starting after existing keys)
-    for (int i = 0; i < srcKeyCount; i++) {
-      IndexNode srcNode = handler->getNodeByRecordAndIndex(srcRecord, i);
-      IndexNode dstNode = handler->getNodeByRecordAndIndex(dstRecord, dstKeyCount + i);
-      dstNode.key = srcNode.key;
-      dstNode.address = srcNode.address;
-      handler->writeIndexItem(dstNode);
-      
-      // Clear source node slot
-      srcNode.key = -1;
-      srcNode.address = -1;
-      handler->writeIndexItem(srcNode);
-    }
-
-    // Mark source record as free and add to free list
-    handler->addToFreeList(srcRecord);
+    int parentRecord = dstParentEntry.getRecordNumber(handler->getRowSize());
 
-    // Remove both parent entries (delete the one with higher pos first to avoid shifting issues)
-    if (srcParentEntry.pos > dstParentEntry.pos) {
-      handler->deleteAtNode(srcParentEntry);
-      handler->deleteAtNode(dstParentEntry);
-    } else {
-      handler->deleteAtNode(dstParentEntry);
-      handler->deleteAtNode(srcParentEntry);
-    }
+    // Copy all keys from source to destination (after existing keys) in one
+    // move
+    NodeView dst = handler->pinNode(dstRecord);
+    NodeView src = handler->pinNode(srcRecord);
+    dst.append(src.entries, src.count());
+    // src is always the right neighbour, so dst takes over its leaf link
+    dst.setNextLeaf(src.nextLeaf());
+    Key mergedMax = dst.key(max(dst.count() - 1, 0));
+    handler->unpinNode(srcRecord, false);
+    handler->unpinNode(dstRecord, true);
+
+    // Mark source record as free (which clears it) and add to free list
+    handler->addToFreeList(srcRecord);
 
-    // Insert new entry with merged max at the position of the earlier parent entry
-    IndexNode insertPos = (dstParentEntry.pos < srcParentEntry.pos) ? dstParentEntry : srcParentEntry;
-    IndexNode newMaxNode = handler->getMaxKeyNode(dstRecord);
-    handler->insertAtNode(insertPos, newMaxNode.key, dstRecord);
+    // Replace both parent entries with a single entry for the merged node at
+    // the position of the earlier one
+    int dstSlot = handler->getSlotIndex(dstParentEntry.pos);
+    int srcSlot = handler->getSlotIndex(srcParentEntry.pos);
+    NodeView parent = handler->pinNode(parentRecord);
+    parent.set(min(dstSlot, srcSlot), mergedMax, dstRecord);
+    parent.removeAt(max(dstSlot, srcSlot));
+    handler->unpinNode(parentRecord, true);
 
     return parentRecord;
   }
 
-  // Handle underflow after deletion (recursive)
-  void handleUnderflow(int nodeRecord, vector<IndexNode> &path) {
+  // Latch a sibling for a borrow or merge. Its parent is latched, so no
+  // other writer can be on its way to it from above.
+  void latchSibling(const IndexNode &sibling, vector<int> &latched) {
+    handler->latchNode(sibling.address, true);
+    latched.push_back(sibling.address);
+  }
+
+  // Handle underflow after deletion (recursive). Siblings used are latched
+  // and added to latched.
+  void handleUnderflow(int nodeRecord, vector<IndexNode> &path,
+                       vector<int> &latched) {
     SiblingInfo siblings = getSiblingInfo(path, nodeRecord);
     if (!siblings.hasParent) {
       return; // No parent means we're root, nothing to do
     }
 
-    int minKeys = getMinKeys();
+    int minKeys = getMinKeys(!handler->isLeafNode(nodeRecord));
 
     // Try to borrow from right sibling first
-    if (siblings.rightSibling.key != -1) {
+    if (siblings.hasRight) {
+      latchSibling(siblings.rightSibling, latched);
       int rightKeyCount = handler->countKeys(siblings.rightSibling.address);
       if (rightKeyCount > minKeys) {
         borrowFromRight(nodeRecord, siblings);
@@ -159,7 +225,8 @@ private:
     }
 
     // Try to borrow from left sibling
-    if (siblings.leftSibling.key != -1) {
+    if (siblings.hasLeft) {
+      latchSibling(siblings.leftSibling, latched);
       int leftKeyCount = handler->countKeys(siblings.leftSibling.address);
       if (leftKeyCount > minKeys) {
         borrowFromLeft(nodeRecord, siblings);
@@ -169,10 +236,11 @@ private:
 
     // Must merge
     int parentRecord;
-    if (siblings.leftSibling.key != -1) {
+    if (siblings.hasLeft) {
       // Merge current into left sibling
-      parentRecord = mergeNodes(siblings.leftSibling.address, nodeRecord, siblings.leftSibling, siblings.parentNode);
-    } else if (siblings.rightSibling.key != -1) {
+      int leftRecord = shadowSibling(siblings.leftSibling);
+      parentRecord = mergeNodes(leftRecord, nodeRecord, siblings.leftSibling, siblings.parentNode);
+    } else if (siblings.hasRight) {
       // Merge right sibling into current
       parentRecord = mergeNodes(nodeRecord, siblings.rightSibling.address, siblings.parentNode, siblings.rightSibling);
     } else {
@@ -182,145 +250,309 @@ private:
     // Check if parent has only 1 child - need to collapse
     IndexNode parentFirstNode = handler->getFirstNode(parentRecord);
     int parentKeyCount = handler->countKeys(parentRecord);
-    
-    if (parentKeyCount == 1) {
-      // Parent has only 1 child - collapse: pull child's content up to parent
+    int rootRecord = handler->getRootRow();
+
+    if (parentKeyCount == 1 && parentRecord == rootRecord) {
+      // Root has only 1 child - collapse it. Below the root a parent with
+      // one child is an ordinary underflow (handled further down), so all
+      // leaves stay at the same depth
       int onlyChildRecord = parentFirstNode.address;
-      
-      // Copy child's node type to parent
-      int childNodeType = handler->isLeafNode(onlyChildRecord) ? 0 : 1;
-      handler->setNodeType(parentRecord, childNodeType);
-      
-      // Copy all keys from child to parent
-      for (int i = 0; i < handler->m; i++) {
-        IndexNode childNode = handler->getNodeByRecordAndIndex(onlyChildRecord, i);
-        IndexNode parentNode = handler->getNodeByRecordAndIndex(parentRecord, i);
-        
-        parentNode.key = childNode.key;
-        parentNode.address = childNode.address;
-        handler->writeIndexItem(parentNode);
-        
-        // Clear child node slot
-        childNode.key = -1;
-        childNode.address = -1;
-        handler->writeIndexItem(childNode);
-        
-        if (parentNode.key == -1) break;
-      }
-      
-      // If parent is not root, we need to update grandparent's pointer
-      // The grandparent already points to parentRecord, so no change needed
-      // But we may need to handle underflow in grandparent if parent was merged
+
+      // The root stays in its row: pull the child's content up into it.
+      // Copy child's node type and all keys to parent in one move, then
+      // free the child
+      NodeView child = handler->pinNode(onlyChildRecord);
+      NodeView parent = handler->pinNode(parentRecord);
+      parent.setNodeType(child.nodeType() == 0 ? 0 : 1);
+      parent.setLevel(child.level());
+      parent.setCount(0);
+      parent.append(child.entries, child.count());
+      parent.setNextLeaf(child.nextLeaf());
+      handler->unpinNode(parentRecord, true);
+      handler->unpinNode(onlyChildRecord, false);
+      handler->addToFreeList(onlyChildRecord);
+      handler->changeTreeSize(0, -1);
       return;
     }
 
     // If parent is root, no underflow check needed
-    if (parentRecord == 1) {
+    if (parentRecord == rootRecord) {
       return;
     }
 
     // Remove entries belonging to this parent from path
-    while (!path.empty() && path.back().getRecordNumber(handler->fileFieldSize, handler->m) == parentRecord) {
+    while (!path.empty() && path.back().getRecordNumber(handler->getRowSize()) == parentRecord) {
       path.pop_back();
     }
 
-    // Check if parent has underflow (less than minKeys)
-    if (parentKeyCount < minKeys) {
-      handleUnderflow(parentRecord, path);
+    // Check if parent has underflow (less than its minimum)
+    if (parentKeyCount < getMinKeys(true)) {
+      handleUnderflow(parentRecord, path, latched);
     }
   }
 
-public:
-  Index(IndexFileHandler *handler) { this->handler = handler; }
+  // Resolve keys[order[begin..end)] (sorted by key) in the subtree at
+  // record, reading every node on the way once for the whole group. record
+  // is latched shared by the caller and stays so while its children are
+  // searched.
+  void searchBatch(int record, const vector<Key> &keys, const vector<int> &order,
+                   int begin, int end, vector<Value> &results) {
+    NodeView node = handler->pinNode(record);
+    int count = node.count();
 
-  // Update parents in path where key equals oldMax with newMax
-  void updateParentsMax(vector<IndexNode> &path, int oldMax, int newMax) {
-    for (int i = path.size() - 1; i >= 0; i--) {
-      if (path[i].key == oldMax) {
-        path[i].key = newMax;
-        handler->writeIndexItem(path[i]);
-      } else {
-        break;
+    if (node.nodeType() == 0) {
+      // Both the batch and the leaf are sorted: one merge pass
+      int i = 0;
+      for (int k = begin; k < end; k++) {
+        const Key &key = keys[order[k]];
+        while (i < count && node.key(i) < key)
+          i++;
+        if (i < count && node.key(i) == key)
+          results[order[k]] = node.address(i);
+      }
+      handler->unpinNode(record, false);
+      return;
+    }
+
+    // Split the group between the children; keys above the last separator
+    // are not in the index
+    vector<pair<int, int>> groups; // (child record, end of its group)
+    int k = begin;
+    for (int i = 0; i < count && k < end; i++) {
+      int groupEnd = k;
+      while (groupEnd < end && keys[order[groupEnd]] <= node.key(i))
+        groupEnd++;
+      if (groupEnd > k) {
+        groups.push_back(make_pair(node.address(i), groupEnd));
+        k = groupEnd;
       }
     }
+    handler->unpinNode(record, false);
+
+    int groupBegin = begin;
+    for (const pair<int, int> &group : groups) {
+      handler->latchNode(group.first, false);
+      searchBatch(group.first, keys, order, groupBegin, group.second, results);
+      handler->unlatchNode(group.first, false);
+      groupBegin = group.second;
+    }
   }
 
-  vector<IndexNode> searchARecordInIndex(char *filename,
-                                                           int RecordID) {
-    // Start from root node (node index 1)
-    int currentRecord = 1;
+  // Root-to-leaf search. Without latched it is a reader's: shared latches
+  // are coupled down the tree and all released at the end. With latched it
+  // is a delete's: exclusive latches, and the nodes above one that can lose
+  // a key without underflowing and without its max changing (its
+  // separator is not RecordID) are released, since nothing above it can
+  // change then. The nodes still held are left in latched and the path
+  // only has entries in them; copy-on-write needs the whole path, so it
+  // keeps it. Nothing is held when RecordID is not found.
+  // A tombstone (see IndexFileHandler::hasTombstones) is not found, unless
+  // tombstone is set: then only a tombstone is.
+  vector<IndexNode> descend(const Key &RecordID, vector<int> *latched,
+                            bool tombstone = false) {
+    bool exclusive = latched != nullptr;
+    vector<int> readerLatches;
+    vector<int> &held = exclusive ? *latched : readerLatches;
+
+    // Start from root node (record 1 unless the file uses shadow paging)
+    int currentRecord = handler->latchRoot(exclusive);
+    held.push_back(currentRecord);
 
     vector<IndexNode> path; // To store the path taken
-    while (currentRecord != -1) {
+    bool found = false;
+    while (true) {
 
-      // Create first IndexRecord for this node
-      IndexNode record = handler->getFirstNode(currentRecord);
+      // View the node in place; only the entries taken are copied
+      NodeView node = handler->pinNode(currentRecord);
 
-      bool isLeaf = handler->isLeafNode(currentRecord);
+      // Keys are sorted: the first key >= RecordID is the match in a leaf
+      // and the separator of the child to descend into otherwise
+      int count = node.count();
+      int itemCol = node.lowerBound(RecordID);
 
-      if (isLeaf) {
-        // Search through keys in leaf node
-        for (int i = 0; i < handler->m; i++) {
-          if (record.key == -1) {
-            return vector<IndexNode>();
-          }
-          if (record.key == RecordID) {
-            path.push_back(record);
-            return path;
-          }
-          record = record.getNextRecord(handler->indexFileName,
-                                        handler->fileFieldSize);
+      if (exclusive && !handler->useShadowPaging && !path.empty() &&
+          !(path.back().key == RecordID) &&
+          count > getMinKeys(node.nodeType() == 1)) {
+        handler->unlatchNodes(held, true, 1);
+        path.clear();
+      }
+
+      if (node.nodeType() == 0) {
+        found = itemCol < count && node.key(itemCol) == RecordID &&
+                handler->isTombstone(node.address(itemCol)) == tombstone;
+        if (found) {
+          path.push_back(IndexNode(node.key(itemCol), node.address(itemCol),
+                                   handler->getSlotPos(currentRecord, itemCol)));
         }
-        return vector<IndexNode>();
+        handler->unpinNode(currentRecord, false);
+        break;
+      }
+      if (itemCol >= count) {
+        handler->unpinNode(currentRecord, false);
+        break;
+      }
+
+      IndexNode entry(node.key(itemCol), node.address(itemCol),
+                      handler->getSlotPos(currentRecord, itemCol));
+      handler->unpinNode(currentRecord, false);
+      int childRecord = entry.address;
+      handler->latchNode(childRecord, exclusive);
+      held.push_back(childRecord);
+      path.push_back(entry);
+
+      if (!exclusive) {
+        handler->unlatchNodes(held, false, 1);
+      }
+      currentRecord = childRecord;
+    }
+
+    if (!exclusive || !found) {
+      handler->unlatchNodes(held, exclusive);
+    }
+    if (!found) {
+      return vector<IndexNode>();
+    }
+    return path;
+  }
+
+  // Lookup without latches, for the memory-mapped mode where rows stay in
+  // place. Each node is stamped with its version before it is read and
+  // validated once the child (or the leaf entry) is taken from it; the
+  // parent is validated again after the child is stamped, so the child was
+  // still linked then. Any change on the way restarts the descent. Reads
+  // may race with a writer, so nothing read is trusted before it is
+  // validated. False if it gives up (the file is not mapped right now, or
+  // writers kept changing the path) and the latched search has to be used.
+  bool searchOptimistic(const Key &RecordID, Value &address) {
+    const int maxAttempts = 8;
+    NodeLatches &latches = handler->pool->latches();
+    for (int attempt = 0; attempt < maxAttempts; attempt++) {
+      char *header = handler->pool->peek(0);
+      uint64_t headerVersion;
+      if (header == nullptr) {
+        return false;
       }
+      if (!latches.stamp(0, headerVersion)) {
+        continue;
+      }
+      int32_t root;
+      memcpy(&root, header + offsetof(FileHeader, root), sizeof(root));
+      int record = root > 0 ? root : 1;
 
-      for (int itemCol = 0; itemCol < handler->m; itemCol++) {
-        if (record.key == -1) {
-          return vector<IndexNode>();
+      uint64_t version;
+      bool valid = latches.stamp(record, version) &&
+                   latches.validate(0, headerVersion);
+      while (valid) {
+        char *row = handler->pool->peek(record);
+        if (row == nullptr) {
+          break;
         }
-        if (RecordID <= record.key) {
-          path.push_back(record);
-          currentRecord = record.address;
+        NodeView node(row, handler->m);
+        int count = node.count();
+        if (count < 0 || count > handler->m) {
+          break; // read while being changed
+        }
+        int itemCol = node.lowerBound(RecordID);
+
+        if (node.nodeType() != 1 || itemCol >= count) {
+          // A leaf, an empty tree or a key above every separator
+          bool found = node.nodeType() == 0 && itemCol < count &&
+                       node.key(itemCol) == RecordID;
+          Value value = found ? node.address(itemCol) : static_cast<Value>(-1);
+          if (!latches.validate(record, version)) {
+            break;
+          }
+          address = value;
+          return true;
+        }
+
+        int childRecord = node.address(itemCol);
+        uint64_t childVersion;
+        if (!latches.validate(record, version) ||
+            !latches.stamp(childRecord, childVersion) ||
+            !latches.validate(record, version)) {
           break;
         }
-        record = record.getNextRecord(handler->indexFileName,
-                                      handler->fileFieldSize);
+        record = childRecord;
+        version = childVersion;
       }
     }
-    return vector<IndexNode>();
+    return false;
   }
 
-  int SearchARecord(char *filename, int RecordID) {
-    vector<IndexNode> results =
-        searchARecordInIndex(filename, RecordID);
-    if (results.empty()) {
-      return -1;
-    } else {
-      return results.back().address;
+  // Keys of the entries with address -1 (tombstones once the file's flag
+  // is set) in the leaf the scan is at, read in a shared
+  // descent (latch coupling, like a search). bound is set to the separator of the leaf, which no key in it
+  // is above, and last to whether it is the last leaf. False if no leaf is
+  // left.
+  bool leafTombstones(const ScanPosition &scan, vector<Key> &dead, Key &bound,
+                      bool &last) {
+    shared_lock<shared_mutex> tree = handler->holdTree();
+    int record = handler->latchRoot(false);
+    last = true;
+    while (true) {
+      NodeView node = handler->pinNode(record);
+      int count = node.count();
+      if (node.nodeType() == 0) {
+        for (int i = 0; i < count; i++) {
+          if (node.address(i) == static_cast<Value>(-1)) {
+            dead.push_back(node.key(i));
+          }
+        }
+        handler->unpinNode(record, false);
+        handler->unlatchNode(record, false);
+        return true;
+      }
+
+      // Children before the first separator above after hold no key above
+      // it
+      int i = scan.started ? node.upperBound(scan.after) : 0;
+      if (i >= count) {
+        handler->unpinNode(record, false);
+        handler->unlatchNode(record, false);
+        return false;
+      }
+      int child = node.address(i);
+      bound = node.key(i);
+      last = last && i == count - 1;
+      handler->unpinNode(record, false);
+      handler->latchNode(child, false);
+      handler->unlatchNode(record, false);
+      record = child;
     }
   }
 
-  // Delete a record from the index
-  void DeleteARecord(char *filename, int RecordID) {
-    // Step 1: Search for the record
-    vector<IndexNode> path =
-        searchARecordInIndex(filename, RecordID);
+  // Delete the entry of RecordID from its leaf and rebalance; with
+  // tombstone, RecordID's tombstone. False if there is none.
+  bool removeEntry(const Key &RecordID, bool tombstone = false) {
+    // Other writers wait here only in the modes that need it
+    unique_lock<mutex> turn = handler->writerTurn();
+
+    // Step 1: Search for the record, latching what the delete can change
+    vector<int> latched;
+    vector<IndexNode> path = descend(RecordID, &latched, tombstone);
     if (path.empty()) {
-      throw runtime_error("Record not found");
+      return false;
     }
+    handler->beginUpdate();
+    shadowPath(path);
 
     // Get the leaf node where the record is
     IndexNode foundRecord = path.back();
-    int recordNumber = foundRecord.getRecordNumber(handler->fileFieldSize, handler->m);
+    int recordNumber = foundRecord.getRecordNumber(handler->getRowSize());
     path.pop_back(); // Remove the found record from path (keep only parents)
 
     // Get current state before deletion
     IndexNode maxNode = handler->getMaxKeyNode(recordNumber);
-    int oldMax = maxNode.key;
+    Key oldMax = maxNode.key;
     int keyCount = handler->countKeys(recordNumber);
 
-    // Step 2: Delete the key from leaf
+    // Step 2: Delete the key from leaf (a tombstone was already taken off
+    // the key count)
     handler->deleteAtNode(foundRecord);
+    if (!tombstone) {
+      handler->changeTreeSize(-1, 0);
+    }
     keyCount--;
 
     // Step 3: Check if deleted key was the max and update parents
@@ -329,13 +561,620 @@ public:
       updateParentsMax(path, oldMax, newMaxNode.key);
     }
 
-    // Step 4: Check for underflow
-    int minKeys = getMinKeys();
-    if (keyCount >= minKeys || recordNumber == 1) {
-      return; // No underflow, or we're the root
+    // Step 4: Check for underflow (the root never underflows)
+    int minKeys = getMinKeys(false);
+    if (keyCount < minKeys && recordNumber != handler->getRootRow()) {
+      // Step 5: Handle underflow
+      handleUnderflow(recordNumber, path, latched);
+    }
+    handler->unlatchNodes(latched, true);
+
+    // Step 6: Write the rows modified in the buffer pool back to the file
+    // (with deferred writes, once enough have gathered)
+    handler->flushOperation();
+    return true;
+  }
+
+  // Lazy delete: set the address of RecordID's leaf entry to -1, which
+  // searches take for a missing key once the file's tombstone flag is set.
+  // Only the leaf (and the header) is written; CompactTombstones removes the
+  // entry later.
+  bool markDeleted(const Key &RecordID) {
+    if (!handler->hasTombstones()) {
+      checkNoAddressIsTombstone();
+    }
+    unique_lock<mutex> turn = handler->writerTurn();
+    vector<int> latched;
+    vector<IndexNode> path = descend(RecordID, &latched);
+    if (path.empty()) {
+      return false;
+    }
+    handler->beginUpdate();
+    shadowPath(path);
+    handler->markTombstones();
+    IndexNode entry = path.back();
+    entry.address = static_cast<Value>(-1);
+    handler->writeIndexItem(entry);
+    handler->changeTreeSize(-1, 0);
+    handler->unlatchNodes(latched, true);
+    handler->flushOperation();
+    return true;
+  }
+
+  // Before the first lazy delete on a file sets its tombstone flag, -1 is
+  // an address like any other: the leaves are read once to make sure no
+  // entry holds it, which the flag would turn into a tombstone. A lazy
+  // delete on another handler sets the flag before its tombstone is
+  // written, so a -1 found with the flag set is one of those.
+  void checkNoAddressIsTombstone() {
+    ScanPosition scan;
+    while (true) {
+      vector<Key> holding;
+      Key bound;
+      bool last;
+      bool found = leafTombstones(scan, holding, bound, last);
+      if (!holding.empty()) {
+        if (handler->hasTombstones()) {
+          return;
+        }
+        throw runtime_error("Lazy deletes need an index with no address -1");
+      }
+      if (!found || last) {
+        return;
+      }
+      scan.after = bound;
+      scan.started = true;
+    }
+  }
+
+  // One DeleteRange (keys null) or DeleteMany pass. Leaves are dropped in
+  // key order; the leaf before a run of dropped leaves is latched before
+  // the first of them goes, and its link is pointed past them afterwards.
+  struct BulkDelete {
+    Key lowKey;
+    Key highKey;
+    const vector<Key> *keys = nullptr; // sorted
+    vector<int> latched;
+    vector<Key> rebalanceKeys; // each leads to a node that lost entries
+    long long removed = 0;     // entries that were not tombstones
+    int before = -1;           // leaf before the dropped ones, -1 if none
+    bool beforeKnown = false;
+    bool relink = false; // leaves dropped since before
+    int after = -1;      // leaf after the last dropped one
+  };
+
+  // Latch a row exclusively unless this pass holds it already
+  void latchOnce(BulkDelete &bulk, int row) {
+    if (find(bulk.latched.begin(), bulk.latched.end(), row) ==
+        bulk.latched.end()) {
+      handler->latchNode(row, true);
+      bulk.latched.push_back(row);
+    }
+  }
+
+  // The leaf before a run about to be dropped: the rightmost leaf of the
+  // subtree at leftRow (-1: the run starts the index). Copy-on-write scans
+  // do not follow the links, so with shadow paging none is looked for.
+  void findLeafBefore(BulkDelete &bulk, int leftRow) {
+    bulk.before = -1;
+    bulk.beforeKnown = true;
+    int row = leftRow;
+    while (row != -1 && !handler->useShadowPaging) {
+      latchOnce(bulk, row);
+      NodeView node = handler->pinNode(row);
+      int count = node.count();
+      bool leaf = node.nodeType() == 0;
+      int last = count > 0 ? node.address(count - 1) : -1;
+      handler->unpinNode(row, false);
+      if (leaf) {
+        bulk.before = row;
+        return;
+      }
+      row = last;
+    }
+  }
+
+  // Point the leaf before the dropped ones at next
+  void relinkTo(BulkDelete &bulk, int next) {
+    if (bulk.relink && bulk.before != -1) {
+      NodeView node = handler->pinNode(bulk.before);
+      node.setNextLeaf(next);
+      handler->unpinNode(bulk.before, true);
+    }
+    bulk.relink = false;
+  }
+
+  // Free a node this pass holds and that has no entries left
+  void dropEmpty(BulkDelete &bulk, int row) {
+    NodeView node = handler->pinNode(row);
+    if (node.nodeType() == 0) {
+      bulk.after = node.nextLeaf();
+    }
+    handler->unpinNode(row, false);
+    handler->addToFreeList(row);
+    bulk.relink = true;
+  }
+
+  // Free the subtree at row, counting the entries of its leaves
+  void dropSubtree(BulkDelete &bulk, int row) {
+    handler->latchNode(row, true);
+    NodeView node = handler->pinNode(row);
+    vector<int> children;
+    if (node.nodeType() == 1) {
+      for (int i = 0; i < node.count(); i++) {
+        children.push_back(node.address(i));
+      }
+    } else if (node.nodeType() == 0) {
+      for (int i = 0; i < node.count(); i++) {
+        bulk.removed += !handler->isTombstone(node.address(i));
+      }
+      bulk.after = node.nextLeaf();
+    }
+    handler->unpinNode(row, false);
+    for (int child : children) {
+      dropSubtree(bulk, child);
+    }
+    handler->addToFreeList(row);
+    handler->unlatchNode(row, true);
+    bulk.relink = true;
+  }
+
+  // Remove the keys of the pass from the subtree at row, which is latched
+  // and safe to change (a copy, under shadow paging). leftRow is the
+  // subtree just before it (-1 if none) and lower a key below all of its
+  // keys (null if none). Children inside the range go whole; the others
+  // that hold keys of the pass are descended into, and freed if that
+  // leaves them empty. The entries of the children gone are removed from
+  // the node in one move.
+  void removeIn(BulkDelete &bulk, int row, int leftRow, const Key *lower) {
+    const vector<Key> *keys = bulk.keys;
+    NodeView node = handler->pinNode(row);
+    int count = node.count();
+
+    if (node.nodeType() == 0) {
+      size_t k = keys && count > 0 ? lower_bound(keys->begin(), keys->end(),
+                                                 node.key(0)) -
+                                         keys->begin()
+                                   : 0;
+      int kept = 0;
+      for (int i = 0; i < count; i++) {
+        const Key &key = node.key(i);
+        bool selected;
+        if (keys) {
+          while (k < keys->size() && (*keys)[k] < key)
+            k++;
+          selected = k < keys->size() && (*keys)[k] == key;
+        } else {
+          selected = !(key < bulk.lowKey) && !(bulk.highKey < key);
+        }
+        if (selected) {
+          bulk.removed += !handler->isTombstone(node.address(i));
+        } else {
+          node.entries[kept++] = node.entries[i];
+        }
+      }
+      node.setCount(kept);
+      if (kept > 0 && kept < count) {
+        bulk.rebalanceKeys.push_back(node.key(0));
+      }
+      handler->unpinNode(row, kept < count);
+      if (kept > 0) {
+        relinkTo(bulk, row);
+        bulk.before = row;
+        bulk.beforeKnown = true;
+      }
+      return;
+    }
+
+    vector<Entry> children(node.entries, node.entries + count);
+    handler->unpinNode(row, false);
+    vector<bool> gone(count, false);
+    bool changed = false;
+    size_t k = keys && lower ? upper_bound(keys->begin(), keys->end(), *lower) -
+                                   keys->begin()
+                             : 0;
+    for (int i = 0; i < count; i++) {
+      const Key &separator = children[i].key;
+      const Key *previous = i > 0 ? &children[i - 1].key : lower;
+      int left = i > 0 ? children[i - 1].address : leftRow;
+
+      // The child holds keys above previous, up to its separator
+      bool touched, inside = false;
+      if (keys) {
+        touched = k < keys->size() && !(separator < (*keys)[k]);
+        while (k < keys->size() && !(separator < (*keys)[k]))
+          k++;
+      } else {
+        if (previous && !(*previous < bulk.highKey)) {
+          break;
+        }
+        touched = !(separator < bulk.lowKey);
+        inside = touched && previous && !(*previous < bulk.lowKey) &&
+                 !(bulk.highKey < separator);
+      }
+      if (!touched) {
+        relinkTo(bulk, bulk.after);
+        bulk.beforeKnown = false;
+        continue;
+      }
+      changed = true;
+
+      if (inside) {
+        if (!bulk.beforeKnown) {
+          findLeafBefore(bulk, left);
+        }
+        dropSubtree(bulk, children[i].address);
+        gone[i] = true;
+        continue;
+      }
+
+      IndexNode entry(separator, children[i].address,
+                      handler->getSlotPos(row, i));
+      latchOnce(bulk, entry.address);
+      int child = shadowSibling(entry);
+      removeIn(bulk, child, left, previous);
+      if (handler->countKeys(child) == 0) {
+        if (!bulk.beforeKnown) {
+          findLeafBefore(bulk, left);
+        }
+        dropEmpty(bulk, child);
+        gone[i] = true;
+      }
+    }
+    if (!changed) {
+      return;
+    }
+
+    node = handler->pinNode(row);
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+      if (!gone[i]) {
+        node.entries[kept++] = node.entries[i];
+      }
+    }
+    node.setCount(kept);
+    if (kept > 0) {
+      bulk.rebalanceKeys.push_back(node.key(0));
+    }
+    handler->unpinNode(row, true);
+  }
+
+  // Merge the child at slot of parentRow with a neighbour if both fit in
+  // one node; otherwise move entries between them so that each has at
+  // least m/2
+  void evenOut(BulkDelete &bulk, int parentRow, int slot) {
+    int leftSlot = slot + 1 < handler->countKeys(parentRow) ? slot : slot - 1;
+    IndexNode leftEntry = handler->getNodeByRecordAndIndex(parentRow, leftSlot);
+    IndexNode rightEntry =
+        handler->getNodeByRecordAndIndex(parentRow, leftSlot + 1);
+    latchOnce(bulk, leftEntry.address);
+    latchOnce(bulk, rightEntry.address);
+    int leftRow = shadowSibling(leftEntry);
+    int rightRow = shadowSibling(rightEntry);
+
+    NodeView left = handler->pinNode(leftRow);
+    NodeView right = handler->pinNode(rightRow);
+    int leftCount = left.count();
+    int rightCount = right.count();
+    if (leftCount + rightCount <= handler->m) {
+      INDEX_COUNT(handler->stats(), merges, 1);
+      left.append(right.entries, rightCount);
+      left.setNextLeaf(right.nextLeaf());
+      handler->unpinNode(rightRow, false);
+      handler->unpinNode(leftRow, true);
+      handler->addToFreeList(rightRow);
+      NodeView parent = handler->pinNode(parentRow);
+      parent.set(leftSlot, parent.key(leftSlot + 1), leftRow);
+      parent.removeAt(leftSlot + 1);
+      handler->unpinNode(parentRow, true);
+      return;
+    }
+
+    int target = (leftCount + rightCount) / 2;
+    if (leftCount < target) {
+      INDEX_COUNT(handler->stats(), borrowsRight, 1);
+      int n = target - leftCount;
+      left.append(right.entries, n);
+      memmove(&right.entries[0], &right.entries[n],
+              (rightCount - n) * sizeof(Entry));
+      right.setCount(rightCount - n);
+    } else {
+      INDEX_COUNT(handler->stats(), borrowsLeft, 1);
+      int n = leftCount - target;
+      memmove(&right.entries[n], &right.entries[0],
+              rightCount * sizeof(Entry));
+      memcpy(&right.entries[0], &left.entries[target], n * sizeof(Entry));
+      right.setCount(rightCount + n);
+      left.setCount(target);
+    }
+    Key leftMax = left.key(target - 1);
+    handler->unpinNode(rightRow, true);
+    handler->unpinNode(leftRow, true);
+    NodeView parent = handler->pinNode(parentRow);
+    parent.set(leftSlot, leftMax, leftRow);
+    handler->unpinNode(parentRow, true);
+  }
+
+  // Pull the only child of the root up into it, as often as it has one.
+  // An internal root left with no child becomes an empty leaf. True if the
+  // root changed.
+  bool collapseRoot(BulkDelete &bulk) {
+    int root = handler->getRootRow();
+    bool changed = false;
+    while (true) {
+      NodeView node = handler->pinNode(root);
+      int count = node.count();
+      bool internal = node.nodeType() == 1;
+      int child = count > 0 ? node.address(0) : -1;
+      if (internal && count == 0) {
+        node.setNodeType(0);
+        node.setLevel(0);
+        node.setNextLeaf(-1);
+        handler->unpinNode(root, true);
+        handler->changeTreeSize(0, 1 - handler->getHeight());
+        return true;
+      }
+      handler->unpinNode(root, false);
+      if (!internal || count != 1) {
+        return changed;
+      }
+
+      latchOnce(bulk, child);
+      NodeView onlyChild = handler->pinNode(child);
+      node = handler->pinNode(root);
+      node.setNodeType(onlyChild.nodeType());
+      node.setLevel(onlyChild.level());
+      node.setCount(0);
+      node.append(onlyChild.entries, onlyChild.count());
+      node.setNextLeaf(onlyChild.nextLeaf());
+      handler->unpinNode(root, true);
+      handler->unpinNode(child, false);
+      handler->addToFreeList(child);
+      handler->changeTreeSize(0, -1);
+      changed = true;
+    }
+  }
+
+  // Bring the nodes on the paths to the rebalance keys back to their
+  // minimum (getMinKeys), top-down, with evenOut. A merge can leave its parent short,
+  // so the paths are walked again until nothing changes.
+  void rebalance(BulkDelete &bulk) {
+    bool changed = true;
+    while (changed) {
+      changed = collapseRoot(bulk);
+      for (const Key &key : bulk.rebalanceKeys) {
+        int row = handler->getRootRow();
+        while (true) {
+          NodeView node = handler->pinNode(row);
+          int count = node.count();
+          int slot = min(node.lowerBound(key), count - 1);
+          bool internal = node.nodeType() == 1;
+          bool childInternal = node.level() > 1;
+          handler->unpinNode(row, false);
+          if (!internal || slot < 0) {
+            break;
+          }
+          IndexNode entry = handler->getNodeByRecordAndIndex(row, slot);
+          latchOnce(bulk, entry.address);
+          int child = shadowSibling(entry);
+          if (count > 1 &&
+              handler->countKeys(child) < getMinKeys(childInternal)) {
+            evenOut(bulk, row, slot);
+            changed = true;
+            continue; // route again through the changed children
+          }
+          row = child;
+        }
+      }
+    }
+  }
+
+  // DeleteRange and DeleteMany: one pass down the tree as one operation,
+  // then the rebalancing of what it left short
+  void bulkDelete(BulkDelete &bulk) {
+    // Other writers wait here only in the modes that need it; the others
+    // wait at the root, which stays latched to the end
+    unique_lock<mutex> turn = handler->writerTurn();
+    int root = handler->latchRoot(true);
+    bulk.latched.push_back(root);
+    NodeView view = handler->pinNode(root);
+    bool empty = view.nodeType() == -1;
+    handler->unpinNode(root, false);
+    if (empty) {
+      handler->unlatchNodes(bulk.latched, true);
+      return;
+    }
+
+    handler->beginUpdate();
+    root = handler->shadowRow(root);
+    handler->setRootRow(root);
+    removeIn(bulk, root, -1, nullptr);
+    relinkTo(bulk, bulk.after);
+    rebalance(bulk);
+    handler->changeTreeSize(-bulk.removed, 0);
+    handler->unlatchNodes(bulk.latched, true);
+    handler->flushOperation();
+  }
+
+  // A call naming a file other than the handler's fails rather than work
+  // on the wrong index
+  void checkFileName(const char *filename) const {
+    if (filename == nullptr || strcmp(filename, handler->indexFileName) != 0) {
+      throw runtime_error("Index is on " + string(handler->indexFileName) +
+                          ", not " + (filename ? filename : "(null)"));
+    }
+  }
+
+public:
+  Index(IndexFileHandler *handler) { this->handler = handler; }
+
+  // Update parents in path where key equals oldMax with newMax
+  void updateParentsMax(vector<IndexNode> &path, const Key &oldMax,
+                        const Key &newMax) {
+    for (int i = path.size() - 1; i >= 0; i--) {
+      if (path[i].key == oldMax) {
+        path[i].key = newMax;
+        handler->writeIndexItem(path[i]);
+      } else {
+        break;
+      }
+    }
+  }
+
+  // Path of entries followed from the root to RecordID's leaf entry, empty
+  // if it is not in the index
+  vector<IndexNode> searchARecordInIndex(char *filename, const Key &RecordID) {
+    shared_lock<shared_mutex> tree = handler->holdTree();
+    return descend(RecordID, nullptr);
+  }
+
+  // Address of RecordID, or -1 (as a Value) if it is not in the index
+  Value SearchARecord(char *filename, const Key &RecordID) {
+    INDEX_TIMED(handler->stats(), searchARecord);
+    INDEX_COUNT(handler->stats(), searches, 1);
+    Value address;
+    if (handler->pool->isMemoryMapped() && searchOptimistic(RecordID, address)) {
+      return address;
+    }
+    vector<IndexNode> results =
+        searchARecordInIndex(filename, RecordID);
+    if (results.empty()) {
+      return static_cast<Value>(-1);
+    } else {
+      return results.back().address;
+    }
+  }
+
+  // Look up a batch of keys in one shared descent: the batch is sorted and
+  // each node is read once for all keys routed through it. Returns the
+  // addresses in the order of keys, -1 for keys not found. filename must
+  // be the handler's file.
+  vector<Value> SearchMany(char *filename, const vector<Key> &keys) {
+    checkFileName(filename);
+    INDEX_TIMED(handler->stats(), searchMany);
+    INDEX_COUNT(handler->stats(), searches, keys.size());
+    vector<Value> results(keys.size(), static_cast<Value>(-1));
+    if (keys.empty()) {
+      return results;
     }
 
-    // Step 5: Handle underflow
-    handleUnderflow(recordNumber, path);
+    vector<int> order(keys.size());
+    for (int i = 0; i < (int)keys.size(); i++) {
+      order[i] = i;
+    }
+    sort(order.begin(), order.end(),
+         [&keys](int a, int b) { return keys[a] < keys[b]; });
+
+    // Start from root node
+    shared_lock<shared_mutex> tree = handler->holdTree();
+    int root = handler->latchRoot(false);
+    searchBatch(root, keys, order, 0, keys.size(), results);
+    handler->unlatchNode(root, false);
+    return results;
+  }
+
+  // All (key, address) pairs with lowKey <= key <= highKey, in key order,
+  // read leaf by leaf through the leaf links. filename must be the
+  // handler's file.
+  vector<pair<Key, Value>> SearchRange(char *filename, const Key &lowKey,
+                                       const Key &highKey) {
+    checkFileName(filename);
+    INDEX_TIMED(handler->stats(), searchRange);
+    INDEX_COUNT(handler->stats(), searches, 1);
+    vector<pair<Key, Value>> results;
+    IndexCursor<Key, Value> cursor(handler);
+    cursor.seek(lowKey, highKey);
+    Key key;
+    Value address;
+    while (cursor.next(key, address)) {
+      results.push_back(make_pair(key, address));
+    }
+    return results;
+  }
+
+  // Delete a record from the index. With handler->lazyDeletes the leaf
+  // entry is only marked deleted (see CompactTombstones).
+  void DeleteARecord(char *filename, const Key &RecordID) {
+    INDEX_TIMED(handler->stats(), deleteARecord);
+    INDEX_COUNT(handler->stats(), deletes, 1);
+    bool found = handler->lazyDeletes ? markDeleted(RecordID)
+                                      : removeEntry(RecordID);
+    if (!found) {
+      throw runtime_error("Record not found");
+    }
+  }
+
+  // Delete every key in [lowKey, highKey] in one operation. Subtrees
+  // inside the range are freed whole, without their keys being deleted one
+  // by one, and only the nodes on the paths to either end of the range are
+  // rebalanced. Returns the number of keys deleted (tombstones in the range
+  // go too, uncounted). filename must be the handler's file.
+  long long DeleteRange(char *filename, const Key &lowKey,
+                        const Key &highKey) {
+    checkFileName(filename);
+    INDEX_TIMED(handler->stats(), deleteRange);
+    BulkDelete bulk;
+    bulk.lowKey = lowKey;
+    bulk.highKey = highKey;
+    if (!(highKey < lowKey)) {
+      bulkDelete(bulk);
+    }
+    INDEX_COUNT(handler->stats(), deletes, bulk.removed);
+    return bulk.removed;
+  }
+
+  // Delete a batch of keys in one operation: one descent shared by the
+  // keys, leaves left empty freed, then the rebalancing of the nodes that
+  // lost entries. Keys not in the index are skipped. Returns the number of
+  // keys deleted. filename must be the handler's file.
+  long long DeleteMany(char *filename, const vector<Key> &sortedKeys) {
+    checkFileName(filename);
+    INDEX_TIMED(handler->stats(), deleteMany);
+    vector<Key> keys(sortedKeys);
+    if (!is_sorted(keys.begin(), keys.end())) {
+      sort(keys.begin(), keys.end());
+    }
+    BulkDelete bulk;
+    bulk.keys = &keys;
+    if (!keys.empty()) {
+      bulkDelete(bulk);
+    }
+    INDEX_COUNT(handler->stats(), deletes, bulk.removed);
+    return bulk.removed;
+  }
+
+  // Remove the tombstones left by lazy deletes, a leaf at a time in key
+  // order, rebalancing after each like DeleteARecord. Stops after
+  // leafBudget leaves or once timeBudget has passed (checked after each
+  // leaf), and the next call goes on from there; a pass that reaches the
+  // last leaf ends the call, and the next one starts again from the first.
+  // Returns the number of tombstones removed.
+  int CompactTombstones(chrono::milliseconds timeBudget,
+                        int leafBudget = INT_MAX) {
+    if (!handler->hasTombstones()) {
+      return 0;
+    }
+    chrono::steady_clock::time_point deadline =
+        chrono::steady_clock::now() + timeBudget;
+    int removed = 0;
+    for (int leaves = 0; leaves < leafBudget; leaves++) {
+      vector<Key> dead;
+      Key bound;
+      bool last;
+      bool found = leafTombstones(compaction, dead, bound, last);
+      for (const Key &key : dead) {
+        removed += removeEntry(key, true);
+      }
+      if (!found || last) {
+        compaction.started = false;
+        break;
+      }
+      compaction.after = bound;
+      compaction.started = true;
+      if (chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+    }
+    return removed;
   }
-};
+};
\ No newline at end of file
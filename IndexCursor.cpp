@@ -0,0 +1,219 @@
+#ifndef INDEX_CURSOR_CPP
+#define INDEX_CURSOR_CPP
+
+#include "IndexFileHandler.cpp"
+#include "ReadAhead.cpp"
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Forward scan over the leaves in key order. seek() descends once from the
+// root to the first key >= lowKey; after that next() only follows the leaf
+// links, reading each leaf once. Copy-on-write updates leave the links of
+// unchanged leaves pointing at replaced rows, so with shadow paging the
+// cursor keeps the internal nodes of its descent and moves to the next
+// child instead.
+// The leaf the cursor is in stays latched (shared) until it moves on, so a
+// scan should be finished or the cursor destroyed before the same thread
+// changes the index. The next leaf is latched only if that needs no
+// waiting, since a writer holding it may be waiting for the current leaf;
+// otherwise the cursor seeks again past the last key it returned.
+// While the leaves it moves through lie one after another in the file (as
+// bulk loading and ascending inserts leave them), the rows ahead of it are
+// prefetched, in a window growing up to handler->readAheadRows.
+template <class Key = int, class Value = int> class IndexCursor {
+private:
+  typedef ::IndexFileHandler<Key, Value> IndexFileHandler;
+  typedef ::NodeView<Key, Value> NodeView;
+
+  IndexFileHandler *handler;
+  int leafRecord = -1; // -1 once the scan is finished
+  int slot = 0;
+  Key lowKey;
+  Key highKey;
+  bool bounded = false; // highKey ends the scan
+  Key lastKey;
+  bool returned = false; // lastKey is set; only keys above it come next
+  vector<pair<int, int>> path; // (internal record, child slot) to the leaf
+  shared_lock<shared_mutex> tree; // see IndexFileHandler::holdTree
+  ReadAhead readAhead;
+
+public:
+  IndexCursor(IndexFileHandler *handler)
+      : readAhead(handler->readAheadRows) {
+    this->handler = handler;
+  }
+
+  IndexCursor(const IndexCursor &) = delete;
+  IndexCursor &operator=(const IndexCursor &) = delete;
+
+  ~IndexCursor() { finish(); }
+
+  // Position on the first key >= lowKey and scan to the end of the index
+  void seek(const Key &lowKey) {
+    start(lowKey);
+    bounded = false;
+  }
+
+  // Position on the first key >= lowKey; keys above highKey end the scan
+  void seek(const Key &lowKey, const Key &highKey) {
+    start(lowKey);
+    this->highKey = highKey;
+    bounded = true;
+  }
+
+  // End the scan, releasing the leaf
+  void finish() {
+    if (leafRecord != -1) {
+      handler->unlatchNode(leafRecord, false);
+      leafRecord = -1;
+    }
+    path.clear();
+    if (tree.owns_lock()) {
+      tree.unlock();
+    }
+  }
+
+  // Fetch the next entry; false at the end of the index or past highKey
+  bool next(Key &key, Value &address) {
+    while (leafRecord != -1) {
+      NodeView leaf = handler->pinNode(leafRecord);
+      if (slot < leaf.count()) {
+        key = leaf.key(slot);
+        address = leaf.address(slot);
+        handler->unpinNode(leafRecord, false);
+        slot++;
+        // Entries marked deleted (tombstones) are skipped
+        if (key < lowKey || (returned && !(lastKey < key)) ||
+            handler->isTombstone(address))
+          continue;
+        if (bounded && highKey < key) {
+          finish();
+          return false;
+        }
+        lastKey = key;
+        returned = true;
+        return true;
+      }
+      int nextLeaf = leaf.nextLeaf();
+      handler->unpinNode(leafRecord, false);
+
+      if (handler->useShadowPaging) {
+        // Writers leave the published tree alone, so waiting is safe
+        nextLeaf = nextLeafOnPath();
+        handler->unlatchNode(leafRecord, false);
+        if (nextLeaf != -1) {
+          handler->latchNode(nextLeaf, false);
+        }
+      } else if (nextLeaf != -1 && !handler->tryLatchNode(nextLeaf)) {
+        handler->unlatchNode(leafRecord, false);
+        leafRecord = -1;
+        this_thread::yield();
+        seekFrom(returned ? lastKey : lowKey);
+        continue;
+      } else {
+        handler->unlatchNode(leafRecord, false);
+      }
+      leafRecord = nextLeaf;
+      slot = 0;
+      if (leafRecord != -1) {
+        moved(leafRecord);
+      }
+    }
+    finish();
+    return false;
+  }
+
+private:
+  void start(const Key &lowKey) {
+    finish();
+    tree = handler->holdTree();
+    this->lowKey = lowKey;
+    returned = false;
+    seekFrom(lowKey);
+  }
+
+  // Descend to the first key >= fromKey, coupling shared latches; the leaf
+  // stays latched
+  void seekFrom(const Key &fromKey) {
+    leafRecord = -1;
+    slot = 0;
+    path.clear();
+
+    int currentRecord = handler->latchRoot(false);
+    while (true) {
+      NodeView node = handler->pinNode(currentRecord);
+      int count = node.count();
+
+      if (node.nodeType() == 0) {
+        // First key >= fromKey, possibly in the next leaf
+        leafRecord = currentRecord;
+        slot = node.lowerBound(fromKey);
+        handler->unpinNode(currentRecord, false);
+        moved(leafRecord);
+        return;
+      }
+
+      // Separators are the max key of their child. A separator left
+      // higher than its child's max by a delete can leave no match here;
+      // the rightmost child then leads to the right leaf through the links
+      int i = min(node.lowerBound(fromKey), count - 1);
+      int childRecord = i >= 0 ? node.address(i) : -1;
+      handler->unpinNode(currentRecord, false);
+      if (childRecord != -1) {
+        handler->latchNode(childRecord, false);
+      }
+      handler->unlatchNode(currentRecord, false);
+      if (childRecord == -1) {
+        return; // the tree is empty
+      }
+      path.push_back(make_pair(currentRecord, i));
+      currentRecord = childRecord;
+    }
+  }
+
+  // Prefetch ahead of the scan while it moves through consecutive rows
+  void moved(int leaf) {
+    int first, count;
+    if (readAhead.next(leaf, first, count)) {
+      handler->pool->prefetch(first, count);
+    }
+  }
+
+  // Leaf after the current one: up to the nearest node with a child to the
+  // right, then down its leftmost path (-1 after the last leaf)
+  int nextLeafOnPath() {
+    while (!path.empty()) {
+      int record = path.back().first;
+      int childSlot = path.back().second + 1;
+      NodeView node = handler->pinNode(record);
+      int count = node.count();
+      int child = childSlot < count ? node.address(childSlot) : -1;
+      handler->unpinNode(record, false);
+      if (child == -1) {
+        path.pop_back();
+        continue;
+      }
+      path.back().second = childSlot;
+
+      while (true) {
+        NodeView down = handler->pinNode(child);
+        bool isLeaf = down.nodeType() == 0;
+        int first = down.count() > 0 ? down.address(0) : -1;
+        handler->unpinNode(child, false);
+        if (isLeaf) {
+          return child;
+        }
+        if (first == -1) {
+          break;
+        }
+        path.push_back(make_pair(child, 0));
+        child = first;
+      }
+    }
+    return -1;
+  }
+};
+
+#endif // INDEX_CURSOR_CPP
@@ -1,67 +1,400 @@
 #ifndef INDEX_FILE_HANDLER_CPP
 #define INDEX_FILE_HANDLER_CPP
 
+#include "BufferPool.cpp"
+#include "FixedKey.cpp"
+#include "NodeSearch.cpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <type_traits>
+#include <unordered_set>
 using namespace std;
 
-class IndexFileHandler; // Forward declaration
+// Keys and addresses are template parameters: Key needs the comparison
+// operators (int32_t, uint64_t and FixedKey<N> all work) and Value must be
+// an integer type, since internal nodes keep child row numbers in it.
+// Everything defaults to int, so IndexFileHandler, Index and BTreeAddition
+// can still be declared without template arguments.
+template <class Key = int, class Value = int> class IndexFileHandler;
 
-struct IndexNode {
+// Fixed part at the start of every row. Entries in use are counted, so no
+// key or address value is reserved as an empty marker.
+struct NodeHeader {
+  int32_t nodeType; // 0 = leaf, 1 = internal, -1 = free
+  int32_t count;    // entries in use
+  int32_t level;    // 0 for leaves, one more than the children otherwise
+  int32_t next;     // next leaf in key order, or next free row; -1 for none
+};
+
+// Row 0 describes the file. Its node header keeps the number of rows in
+// count and the head of the free list in next; the rest identifies the
+// format so a file is never read with the wrong layout, and says where the
+// root is.
+struct FileHeader {
+  NodeHeader node;
+  int32_t magic;
+  int32_t version;
+  int32_t pageSize;
+  int32_t m;
+  int32_t keySize;
+  int32_t valueSize;
+  int32_t root;  // row of the root (version 2 on; record 1 before)
+  int32_t flags; // indexFile* flags (version 2 on)
+  int64_t keyCount; // entries in the leaves (version 3 on)
+  int32_t height;   // levels of the tree, 0 before the first insert; a root
+                    // leaf emptied by deletes stays, at 1 (version 3 on)
+};
+
+const int32_t indexFileMagic = 0x58495442; // "BTIX"
+const int32_t indexFileVersion = 4;
+const int32_t indexFileShadowPaging = 1; // updates are copy-on-write
+const int32_t indexFileTombstones = 2;   // leaf address -1 is a tombstone (version 4 on)
+
+template <class Key, class Value> struct IndexEntry {
+  Key key;
+  Value address;
+};
+
+template <class Key = int, class Value = int> struct IndexNode {
     // make sure to check for end of record when using nextRecordPos can access
     // next record
-    int key;
-    int address;
-    int pos;
-
-    IndexNode(int pos, const char *indexFileName,
-              int fileFieldSize) {
-      ifstream indexFile = ifstream(indexFileName, ios::binary);
-      if (!indexFile) {
-        throw runtime_error("Could not open index file");
+    Key key;
+    Value address;
+    long long pos; // byte offset of the entry in the file
+
+    // Reads the key/address pair at pos through the handler's buffer pool
+    IndexNode(long long pos, const IndexFileHandler<Key, Value> *handler);
+
+    // Entry already read through a NodeView
+    IndexNode(const Key &key, Value address, long long pos)
+        : key(key), address(address), pos(pos) {}
+
+    IndexNode getNextRecord(const IndexFileHandler<Key, Value> *handler) const;
+
+    int getRecordNumber(int rowSize) const { return this->pos / rowSize; }
+  };
+
+// Typed view over a pinned row: [header, entry1, ..., entryM, padding].
+// It points into the buffer pool frame (or the file mapping), so nothing is
+// copied; it is only valid until the row is unpinned.
+template <class Key = int, class Value = int> struct NodeView {
+    typedef IndexEntry<Key, Value> Entry;
+
+    NodeHeader *header;
+    Entry *entries;
+    int m;
+
+    NodeView(char *row, int m)
+        : header(reinterpret_cast<NodeHeader *>(row)),
+          entries(reinterpret_cast<Entry *>(row + sizeof(NodeHeader))), m(m) {}
+
+    int nodeType() const { return header->nodeType; }
+    void setNodeType(int nodeType) { header->nodeType = nodeType; }
+
+    int level() const { return header->level; }
+    void setLevel(int level) { header->level = level; }
+
+    const Key &key(int i) const { return entries[i].key; }
+    Value address(int i) const { return entries[i].address; }
+
+    // Row of the next leaf in key order (-1 for the last leaf and for
+    // internal rows; the next free row in free rows)
+    int nextLeaf() const { return header->next; }
+    void setNextLeaf(int row) { header->next = row; }
+
+    void set(int i, const Key &key, Value address) {
+      entries[i].key = key;
+      entries[i].address = address;
+    }
+
+    int count() const { return header->count; }
+    void setCount(int count) { header->count = count; }
+
+    // First entry with a key >= key (count() if none)
+    int lowerBound(const Key &key) const {
+      if constexpr (isInt32Pair()) {
+        return nodeLowerBoundInt32(&entries[0].key, count(), key);
+      } else {
+        return nodeLowerBound(entries, count(), key);
+      }
+    }
+
+    // First entry with a key > key (count() if none)
+    int upperBound(const Key &key) const {
+      if constexpr (isInt32Pair()) {
+        return key == INT_MAX ? count() : lowerBound(key + 1);
+      } else {
+        return nodeUpperBound(entries, count(), key);
       }
-      indexFile.seekg(pos);
-      indexFile.read(reinterpret_cast<char *>(&key), fileFieldSize);
-      indexFile.seekg(pos + fileFieldSize);
-      indexFile.read(reinterpret_cast<char *>(&address), fileFieldSize);
-      indexFile.close();
-      this->pos = pos;
     }
 
-    IndexNode getNextRecord(const char *indexFileName, int fileFieldSize) const {
-      return IndexNode(this->pos + 2 * fileFieldSize, indexFileName,
-                       fileFieldSize);
+    // Remove entry i, moving the tail left once
+    void removeAt(int i) {
+      int n = count();
+      memmove(&entries[i], &entries[i + 1], (n - i - 1) * sizeof(Entry));
+      setCount(n - 1);
     }
 
-    int getRecordNumber(int fileFieldSize, int m) const {
-      return this->pos / (fileFieldSize * (2 * m + 1));
+    // Insert at i, moving the tail right once; the node must not be full
+    void insertAt(int i, const Key &key, Value address) {
+      int n = count();
+      memmove(&entries[i + 1], &entries[i], (n - i) * sizeof(Entry));
+      set(i, key, address);
+      setCount(n + 1);
     }
 
+    // Append n entries copied from src in one move
+    void append(const Entry *src, int n) {
+      memcpy(&entries[count()], src, n * sizeof(Entry));
+      setCount(count() + n);
+    }
+
+  private:
+    // int keys with int addresses are searched with the SIMD kernels
+    static constexpr bool isInt32Pair() {
+      return is_same<Key, int>::value && sizeof(Entry) == 2 * sizeof(int);
+    }
   };
 
-class IndexFileHandler {
+// Handlers on the same file share its buffer pool and node latches, so
+// threads can search and update it side by side; each thread uses its own
+// handler (and its own Index or BTreeAddition).
+template <class Key, class Value> class IndexFileHandler {
+  static_assert(is_integral<Value>::value,
+                "Addresses also hold row numbers and must be integers");
+
 public:
-  int fileFieldSize = sizeof(int);
+  typedef ::IndexNode<Key, Value> IndexNode;
+  typedef ::NodeView<Key, Value> NodeView;
+  typedef IndexEntry<Key, Value> Entry;
+
   char *indexFileName;
   int numberOfRecords;
   int m;
+  int pageSize = 4096; // for new files; an existing file keeps its own
+  int bufferPoolFrames = 64;
+  bool useMemoryMap = false; // map the file instead of caching rows in frames
+  bool useWriteAheadLog = false; // log each insert or delete as one commit
+  int logGroupCommit = 1;        // commits per log fsync
+  bool useShadowPaging = false;  // copy-on-write updates, set by the file once open
+  bool deferWrites = false;      // keep dirty rows in memory between operations
+  int deferredRows = 1024;       // write back once this many rows are dirty
+  int deferredMillis = 1000;     // or once this long has passed
+  int readAheadRows = 256;       // largest read-ahead window of a scan, 0: none
+  bool lazyDeletes = false;      // deletes only mark the entry (tombstones)
+  shared_ptr<BufferPool> pool;
 
-  void writeIndexItem(IndexNode node) {
-    fstream indexFile =
-        fstream(indexFileName, ios::binary | ios::in | ios::out);
-    indexFile.seekp(node.pos);
-    indexFile.write(reinterpret_cast<char *>(&node.key), fileFieldSize);
-    indexFile.write(reinterpret_cast<char *>(&node.address), fileFieldSize);
-    indexFile.close();
+  // Largest m whose node fills exactly one page
+  static int orderForPageSize(int pageSize) {
+    return (pageSize - (int)sizeof(NodeHeader)) / (int)sizeof(Entry);
+  }
+
+  // Bytes per row: the node rounded up to a power of two while it fits in a
+  // page, otherwise to whole pages. Rows then never cross a page boundary
+  // and every node is read with a single I/O.
+  static int rowSizeFor(int m, int pageSize) {
+    int bytes = max(sizeof(NodeHeader) + m * sizeof(Entry), sizeof(FileHeader));
+    if (bytes > pageSize) {
+      return (bytes + pageSize - 1) / pageSize * pageSize;
+    }
+    int rowSize = sizeof(NodeHeader);
+    while (rowSize < bytes) {
+      rowSize *= 2;
+    }
+    return rowSize;
+  }
+
+  // Attach to an existing index file. Only its header is read: the page
+  // size, m, row count and root row are all in record 0. Rows are cached in
+  // the pool shared by every handler on the same file. Operations a crash
+  // left in the write-ahead log are replayed first, and a file of an older
+  // version gets the header fields it lacks.
+  void openIndexFile(char *filename) {
+    FileHeader header = readFileHeader(filename);
+    this->pageSize = header.pageSize;
+    this->useShadowPaging = header.flags & indexFileShadowPaging;
+    checkModes();
+    attach(filename, header.node.count, header.m);
+    INDEX_COUNT(stats(), fileOpens, 1);
+    {
+      // Handlers opening the file meanwhile wait until it is repaired
+      lock_guard<mutex> turn(pool->latches().writer);
+      if (pool->claimRecovery()) {
+        pool->replayLog();
+        if (useShadowPaging) {
+          repairFreeList();
+        }
+        if (header.version < indexFileVersion) {
+          upgradeHeader();
+        }
+      }
+    }
+    if (useWriteAheadLog) {
+      pool->startLog(logGroupCommit);
+    }
+    if (deferWrites) {
+      pool->deferWrites(deferredRows, chrono::milliseconds(deferredMillis));
+    }
+  }
+
+  // The same, checked against the m and row count the file was created
+  // with (it only grows past that count)
+  void openIndexFile(char *filename, int numberOfRecords, int m) {
+    openIndexFile(filename);
+    if (m != this->m || numberOfRecords > this->numberOfRecords) {
+      throw runtime_error("Index file has m = " + to_string(this->m) + " and " +
+                          to_string(this->numberOfRecords) +
+                          " records, not m = " + to_string(m) + " and " +
+                          to_string(numberOfRecords));
+    }
+  }
+
+  // Write back rows modified since the last flush (with the write-ahead
+  // log: commit them as one operation; with shadow paging: publish the
+  // update)
+  void flush() {
+    if (updating) {
+      publishUpdate();
+      return;
+    }
+    pool->flush();
   }
 
-  int getRecordStart(int recordNumber) const {
-    return fileFieldSize * (2 * this->m + 1) * recordNumber;
+  // The flush at the end of an insert or delete. With deferWrites the rows
+  // stay in memory until the size or time threshold is reached; flush()
+  // writes them at once.
+  void flushOperation() {
+    if (updating) {
+      publishUpdate();
+      return;
+    }
+    pool->flushIfDue();
+  }
+
+  // Make every operation flushed so far durable
+  void sync() { pool->sync(); }
+
+  // Counters and call latencies of the file (see IndexStats)
+  IndexStats &stats() const { return pool->stats(); }
+
+  int getRowSize() const { return rowSize; }
+
+  // Header fields are 32-bit ints at a byte offset in the file
+  int readField(long long pos) const {
+    int row = pos / getRowSize();
+    int value;
+    char *frame = pool->pin(row);
+    memcpy(&value, frame + pos % getRowSize(), sizeof(int));
+    pool->unpin(row, false);
+    return value;
+  }
+
+  void writeField(long long pos, int value) {
+    int row = pos / getRowSize();
+    char *frame = pool->pin(row);
+    memcpy(frame + pos % getRowSize(), &value, sizeof(int));
+    pool->unpin(row, true);
+  }
+
+  void writeIndexItem(const IndexNode &node) {
+    int row = node.pos / getRowSize();
+    char *slot = pool->pin(row) + node.pos % getRowSize();
+    memcpy(slot + offsetof(Entry, key), &node.key, sizeof(Key));
+    memcpy(slot + offsetof(Entry, address), &node.address, sizeof(Value));
+    pool->unpin(row, true);
+  }
+
+  long long getRecordStart(int recordNumber) const {
+    return (long long)getRowSize() * recordNumber;
+  }
+
+  long long getSlotPos(int recordNumber, int keyIndex) const {
+    return getRecordStart(recordNumber) + sizeof(NodeHeader) +
+           keyIndex * sizeof(Entry);
   }
 
   IndexNode getNodeByRecordAndIndex(int recordNumber, int keyIndex) const {
-    int pos = getRecordStart(recordNumber) + fileFieldSize * (1 + 2 * keyIndex);
-    return IndexNode(pos, this->indexFileName, this->fileFieldSize);
+    return IndexNode(getSlotPos(recordNumber, keyIndex), this);
+  }
+
+  // Pin a row and view it in place; pair every call with unpinNode
+  NodeView pinNode(int recordNumber) const {
+    return NodeView(pool->pin(recordNumber), m);
+  }
+
+  void unpinNode(int recordNumber, bool dirty) const {
+    pool->unpin(recordNumber, dirty);
+  }
+
+  // Node latches. Readers couple shared latches down the tree (a child is
+  // latched before its parent is released); writers take exclusive ones
+  // and keep only the part of the path a split or merge can still reach.
+  // Copy-on-write writers change only rows no reader reaches before the
+  // update is published, so with shadow paging they take none.
+  void latchNode(int recordNumber, bool exclusive) const {
+    if (!exclusive) {
+      pool->latches().lockShared(recordNumber);
+    } else if (!useShadowPaging) {
+      pool->latches().lock(recordNumber);
+    }
+  }
+
+  void unlatchNode(int recordNumber, bool exclusive) const {
+    if (!exclusive) {
+      pool->latches().unlockShared(recordNumber);
+    } else if (!useShadowPaging) {
+      pool->latches().unlock(recordNumber);
+    }
+  }
+
+  // Shared latch taken only if it is free right away. Moving to a sibling
+  // goes against the top-down order, so waiting there could deadlock.
+  bool tryLatchNode(int recordNumber) const {
+    return pool->latches().tryLockShared(recordNumber);
+  }
+
+  // Release the latches on records, except the last keep of them
+  void unlatchNodes(vector<int> &records, bool exclusive, int keep = 0) const {
+    int count = records.size();
+    for (int i = 0; i + keep < count; i++) {
+      unlatchNode(records[i], exclusive);
+    }
+    records.erase(records.begin(), records.end() - keep);
+  }
+
+  // Latch the root and return its row. A root split can move the root, so
+  // it is checked again once latched.
+  int latchRoot(bool exclusive) const {
+    while (true) {
+      int root = getRootRow();
+      latchNode(root, exclusive);
+      if (getRootRow() == root) {
+        return root;
+      }
+      unlatchNode(root, exclusive);
+    }
+  }
+
+  // Writers take turns where one flush covers every change since the last
+  // (write-ahead log, shadow paging); otherwise node latches are enough
+  unique_lock<mutex> writerTurn() const {
+    if (useShadowPaging || pool->isLogged()) {
+      return unique_lock<mutex>(pool->latches().writer);
+    }
+    return unique_lock<mutex>();
+  }
+
+  // Held by a reader for a whole search or scan: with shadow paging an
+  // update is published only once no reader is left in the old tree
+  shared_lock<shared_mutex> holdTree() const {
+    if (useShadowPaging) {
+      lock_guard<mutex> gate(pool->latches().treeGate);
+      return shared_lock<shared_mutex>(pool->latches().tree);
+    }
+    return shared_lock<shared_mutex>();
   }
 
   IndexNode getFirstNode(int recordNumber) const {
@@ -70,176 +403,598 @@ public:
 
   // Count keys in a record
   int countKeys(int recordNumber) const {
-    int count = 0;
-    IndexNode node = getFirstNode(recordNumber);
-    for (int i = 0; i < m; i++) {
-      if (node.key == -1)
-        break;
-      count++;
-      node = node.getNextRecord(indexFileName, fileFieldSize);
-    }
+    NodeView node = pinNode(recordNumber);
+    int count = node.count();
+    unpinNode(recordNumber, false);
     return count;
   }
 
   // Get max key node in a record (last valid key)
   IndexNode getMaxKeyNode(int recordNumber) const {
-    IndexNode node = getFirstNode(recordNumber);
-    IndexNode maxNode = node;
-    for (int i = 0; i < m; i++) {
-      if (node.key == -1)
-        break;
-      maxNode = node;
-      node = node.getNextRecord(indexFileName, fileFieldSize);
-    }
+    NodeView node = pinNode(recordNumber);
+    int last = max(node.count() - 1, 0);
+    IndexNode maxNode(node.key(last), node.address(last),
+                      getSlotPos(recordNumber, last));
+    unpinNode(recordNumber, false);
     return maxNode;
   }
 
+  // Slot index of an entry position within its record
+  int getSlotIndex(long long pos) const {
+    return (pos % getRowSize() - sizeof(NodeHeader)) / sizeof(Entry);
+  }
+
   bool isLeafNode(int recordNumber) const {
-    int pos = getRecordStart(recordNumber);
-    ifstream indexFile = ifstream(this->indexFileName, ios::binary);
-    if (!indexFile) {
-      throw runtime_error("Could not open index file");
-    }
-    indexFile.seekg(pos);
-    int nodeType;
-    indexFile.read(reinterpret_cast<char *>(&nodeType), sizeof(int));
-    return nodeType == 0;
+    return readField(getRecordStart(recordNumber)) == 0;
   }
 
   // Set node type for a record (0=leaf, 1=internal, -1=free)
   void setNodeType(int recordNumber, int nodeType) {
-    int pos = getRecordStart(recordNumber);
-    fstream file(indexFileName, ios::binary | ios::in | ios::out);
-    file.seekp(pos);
-    file.write(reinterpret_cast<char*>(&nodeType), fileFieldSize);
-    file.close();
+    writeField(getRecordStart(recordNumber), nodeType);
+  }
+
+  // Head of the free list, kept in record 0 (-1 when empty)
+  int getFreeListHead() const {
+    NodeView header = pinNode(0);
+    int head = header.nextLeaf();
+    unpinNode(0, false);
+    return head;
+  }
+
+  void setFreeListHead(int recordNumber) {
+    NodeView header = pinNode(0);
+    header.setNextLeaf(recordNumber);
+    unpinNode(0, true);
+  }
+
+  // Row of the root. It is record 1 unless the file uses shadow paging,
+  // where every update moves it; an update in progress sees its own root.
+  // The field is read and written under record 0's latch.
+  int getRootRow() const {
+    if (updating) {
+      return pendingRoot;
+    }
+    pool->latches().lockShared(0);
+    int root = readField(offsetof(FileHeader, root));
+    pool->latches().unlockShared(0);
+    return root > 0 ? root : 1;
+  }
+
+  void setRootRow(int row) {
+    if (updating) {
+      pendingRoot = row;
+      return;
+    }
+    pool->latches().lock(0);
+    writeField(offsetof(FileHeader, root), row);
+    pool->latches().unlock(0);
+  }
+
+  // Entries in the index and levels of the tree, kept in the header. Like
+  // the root, they are read and changed under record 0's latch, and an
+  // update in progress keeps its changes aside until it is published.
+  long long getKeyCount() const {
+    pool->latches().lockShared(0);
+    const FileHeader *header =
+        reinterpret_cast<const FileHeader *>(pool->pin(0));
+    long long keys = header->keyCount;
+    pool->unpin(0, false);
+    pool->latches().unlockShared(0);
+    return keys + (updating ? pendingKeys : 0);
+  }
+
+  int getHeight() const {
+    pool->latches().lockShared(0);
+    const FileHeader *header =
+        reinterpret_cast<const FileHeader *>(pool->pin(0));
+    int height = header->height;
+    pool->unpin(0, false);
+    pool->latches().unlockShared(0);
+    return height + (updating ? pendingLevels : 0);
+  }
+
+  // Whether leaf entries with address -1 are tombstones. Until the first
+  // lazy delete sets the file's flag, -1 is an address like any other.
+  bool hasTombstones() const {
+    pool->latches().lockShared(0);
+    int flags = readField(offsetof(FileHeader, flags));
+    pool->latches().unlockShared(0);
+    return flags & indexFileTombstones;
+  }
+
+  bool isTombstone(Value address) const {
+    return address == static_cast<Value>(-1) && hasTombstones();
+  }
+
+  // Set the file's tombstone flag (kept from then on)
+  void markTombstones() {
+    if (hasTombstones()) {
+      return;
+    }
+    pool->latches().lock(0);
+    int flags = readField(offsetof(FileHeader, flags));
+    writeField(offsetof(FileHeader, flags), flags | indexFileTombstones);
+    pool->latches().unlock(0);
+  }
+
+  void changeTreeSize(long long keys, int levels) {
+    if (updating) {
+      pendingKeys += keys;
+      pendingLevels += levels;
+      return;
+    }
+    pool->latches().lock(0);
+    FileHeader *header = reinterpret_cast<FileHeader *>(pool->pin(0));
+    header->keyCount += keys;
+    header->height += levels;
+    pool->unpin(0, true);
+    pool->latches().unlock(0);
+  }
+
+  // Start a copy-on-write update (nothing to do without shadow paging).
+  // Until flush() publishes it, changes go to copies of the rows and record
+  // 0 stays pinned, so readers of the published root see the old tree and
+  // a crash leaves it intact.
+  void beginUpdate() {
+    if (!useShadowPaging || updating) {
+      return;
+    }
+    pendingRoot = getRootRow();
+    pendingKeys = 0;
+    pendingLevels = 0;
+    pool->pin(0);
+    updating = true;
+  }
+
+  // Row to change in place of row during an update: a copy taken from the
+  // free list, or row itself if the update made it. The caller points the
+  // parent entry at the copy; row is freed once the update is published.
+  int shadowRow(int row) {
+    if (!updating || freshRows.count(row)) {
+      return row;
+    }
+    int copy = takeFreeRow();
+    char *source = pool->pin(row);
+    memcpy(pool->pin(copy), source, getRowSize());
+    pool->unpin(copy, true);
+    pool->unpin(row, false);
+    retireRow(row);
+    return copy;
+  }
+
+  // Pop the head of the free list, growing the file when it is empty
+  int takeFreeRow() {
+    lock_guard<mutex> hold(pool->latches().freeList);
+    int row = getFreeListHead();
+    if (row == -1) {
+      row = growIndexFile();
+    }
+    NodeView node = pinNode(row);
+    int next = node.nextLeaf();
+    unpinNode(row, false);
+    setFreeListHead(next);
+    INDEX_COUNT(stats(), freeListPops, 1);
+    if (updating) {
+      freshRows.insert(row);
+    }
+    return row;
+  }
+
+  // Number of rows in the file, kept in record 0
+  int getRowCount() const {
+    NodeView header = pinNode(0);
+    int rows = header.count();
+    unpinNode(0, false);
+    return rows > 0 ? rows : numberOfRecords;
+  }
+
+  // Append a chunk of free rows when the free list runs out and return the
+  // first one, which becomes the free list head. The file doubles each time
+  // (at least minGrowthRows rows). Callers hold the free list mutex unless
+  // they have the file to themselves.
+  int growIndexFile() {
+    const int minGrowthRows = 16;
+    const int chunkRows = 1024; // rows written per call
+    int oldCount = getRowCount();
+    int newCount = oldCount + max(oldCount, minGrowthRows);
+    int freeListHead = getFreeListHead();
+
+    int rowSize = getRowSize();
+    vector<char> chunk((size_t)chunkRows * rowSize);
+    for (int first = oldCount; first < newCount; first += chunkRows) {
+      int rows = min(chunkRows, newCount - first);
+      for (int i = 0; i < rows; i++) {
+        int record = first + i;
+        // Chain the new rows, the last one onto whatever is left of the list
+        initFreeRow(&chunk[(size_t)i * rowSize],
+                    record + 1 < newCount ? record + 1 : freeListHead);
+      }
+      pool->appendRows(first, rows, chunk.data());
+    }
+
+    numberOfRecords = newCount;
+    NodeView header = pinNode(0);
+    header.setCount(newCount);
+    header.setNextLeaf(oldCount);
+    unpinNode(0, true);
+    return oldCount;
   }
 
   // Add a record to the free list
   void addToFreeList(int recordNumber) {
-    // Read current free list head from record 0
-    IndexNode freeListHead = getFirstNode(0);
-    int currentFreeHead = freeListHead.key;
-    
-    // Mark record as free: nodeType=-1, first slot points to old free head
-    int recordStart = getRecordStart(recordNumber);
-    fstream file(indexFileName, ios::binary | ios::in | ios::out);
-    int freeMarker = -1;
-    file.seekp(recordStart);
-    file.write(reinterpret_cast<char*>(&freeMarker), fileFieldSize); // nodeType = -1
-    file.write(reinterpret_cast<char*>(&currentFreeHead), fileFieldSize); // points to old head
-    file.close();
-    
+    // A row the published tree still uses is freed with the update
+    if (updating) {
+      if (!freshRows.count(recordNumber)) {
+        retireRow(recordNumber);
+        return;
+      }
+      freshRows.erase(recordNumber);
+    }
+
+    // Mark record as free: nodeType=-1, pointing to the old free head
+    lock_guard<mutex> hold(pool->latches().freeList);
+    int currentFreeHead = getFreeListHead();
+    NodeView node = pinNode(recordNumber);
+    node.setNodeType(-1);
+    node.setCount(0);
+    node.setLevel(-1);
+    node.setNextLeaf(currentFreeHead);
+    unpinNode(recordNumber, true);
+
     // Update free list head in record 0 to point to this record
-    freeListHead.key = recordNumber;
-    writeIndexItem(freeListHead);
+    setFreeListHead(recordNumber);
+    INDEX_COUNT(stats(), freeListPushes, 1);
   }
 
   // Delete at node position and shift remaining keys left
-  void deleteAtNode(IndexNode deleteNode) {
-    int recordNumber = deleteNode.getRecordNumber(fileFieldSize, m);
-    int recordEnd = getRecordStart(recordNumber) + fileFieldSize * (2 * m + 1);
-    
-    IndexNode currNode = deleteNode;
-    IndexNode nextNode = currNode.getNextRecord(indexFileName, fileFieldSize);
-    
-    // Shift all keys and addresses left (within record bounds)
-    while (nextNode.pos < recordEnd && nextNode.key != -1) {
-      currNode.key = nextNode.key;
-      currNode.address = nextNode.address;
-      writeIndexItem(currNode);
-      currNode = nextNode;
-      nextNode = nextNode.getNextRecord(indexFileName, fileFieldSize);
-    }
-    // Clear the last slot
-    currNode.key = -1;
-    currNode.address = -1;
-    writeIndexItem(currNode);
+  void deleteAtNode(const IndexNode &deleteNode) {
+    int recordNumber = deleteNode.getRecordNumber(getRowSize());
+    NodeView node = pinNode(recordNumber);
+    node.removeAt(getSlotIndex(deleteNode.pos));
+    unpinNode(recordNumber, true);
   }
 
   // Insert key-addr at node position (shift remaining right)
-  void insertAtNode(IndexNode insertNode, int key, int addr) {
-    // First find the last valid node (first empty slot)
-    IndexNode node = insertNode;
-    while (node.key != -1) {
-      node = node.getNextRecord(indexFileName, fileFieldSize);
-    }
-    
-    // Shift from end to insert position
-    IndexNode emptySlot = node;
-    while (emptySlot.pos > insertNode.pos) {
-      IndexNode prevNode = IndexNode(
-          emptySlot.pos - 2 * fileFieldSize, 
-          indexFileName, fileFieldSize);
-      emptySlot.key = prevNode.key;
-      emptySlot.address = prevNode.address;
-      writeIndexItem(emptySlot);
-      emptySlot = prevNode;
-    }
-    
-    // Insert at position
-    insertNode.key = key;
-    insertNode.address = addr;
-    writeIndexItem(insertNode);
+  void insertAtNode(const IndexNode &insertNode, const Key &key, Value addr) {
+    int recordNumber = insertNode.getRecordNumber(getRowSize());
+    NodeView node = pinNode(recordNumber);
+    if (node.count() == m) {
+      unpinNode(recordNumber, false);
+      throw runtime_error("No empty slot in node");
+    }
+    node.insertAt(getSlotIndex(insertNode.pos), key, addr);
+    unpinNode(recordNumber, true);
+  }
+
+  // Create an empty index whose nodes each fill one page
+  void createIndexFile(char *filename, int numberOfRecords) {
+    createIndexFile(filename, numberOfRecords, orderForPageSize(pageSize));
   }
 
   void createIndexFile(char *filename, int numberOfRecords, int m) {
+    if (pageSize < (int)sizeof(FileHeader) || (pageSize & (pageSize - 1))) {
+      throw runtime_error("Page size must be a power of two of at least " +
+                          to_string(sizeof(FileHeader)) + " bytes");
+    }
+    checkModes();
+    updating = false;
+    freshRows.clear();
+    retiredRows.clear();
+
+    // Cached rows of a previous file must not be written over the new one
+    if (pool) {
+      pool->discard();
+      pool.reset();
+    }
+    BufferPool::discardFile(filename);
+    setGeometry(filename, numberOfRecords, m);
+
     ofstream indexFile;
     indexFile.open(filename, ios::binary);
     if (!indexFile) {
       throw runtime_error("Could not create index file");
     }
-    this->numberOfRecords = numberOfRecords;
-    this->m = m;
-
-    int cols = 2 * this->m + 1;
 
-    // Initialize all records
+    // Initialize all records: record 0 holds the file header, the row count
+    // and the free list head, every other record is free and points to the
+    // next one (-1 if last)
+    vector<char> row(getRowSize());
     for (int record = 0; record < this->numberOfRecords; record++) {
-      for (int col = 0; col < cols; col++) {
-        int value;
-        if (col == 1) {
-          // Second column: linked list of empty nodes
-          // Points to next empty node (record+1), or -1 if last
-          if (record < this->numberOfRecords - 1) {
-            value = record + 1;
-          } else {
-            value = -1;
-          }
-        } else {
-          value = -1;
-        }
-        indexFile.write(reinterpret_cast<char *>(&value), sizeof(int));
+      initFreeRow(row.data(),
+                  record < this->numberOfRecords - 1 ? record + 1 : -1);
+      if (record == 0) {
+        FileHeader *header = reinterpret_cast<FileHeader *>(row.data());
+        header->node.count = this->numberOfRecords;
+        header->magic = indexFileMagic;
+        header->version = indexFileVersion;
+        header->pageSize = pageSize;
+        header->m = this->m;
+        header->keySize = sizeof(Key);
+        header->valueSize = sizeof(Value);
+        header->root = 1;
+        header->flags = useShadowPaging ? indexFileShadowPaging : 0;
+        header->keyCount = 0;
+        header->height = 0;
       }
+      indexFile.write(row.data(), row.size());
     }
 
     indexFile.close();
-    this->indexFileName = filename;
+    pool = BufferPool::create(filename, getRowSize(), bufferPoolFrames,
+                              useMemoryMap);
+    pool->resetLog(useWriteAheadLog, logGroupCommit);
+    INDEX_COUNT(stats(), fileOpens, 1);
+    if (deferWrites) {
+      pool->deferWrites(deferredRows, chrono::milliseconds(deferredMillis));
+    }
   }
 
+  // One line per record: type, count, level, next, then the entries in use
   void DisplayIndexFileContent(char *filename) {
+    if (pool) {
+      sync();
+    }
     ifstream indexFile;
     indexFile.open(filename, ios::binary);
     if (!indexFile) {
       throw runtime_error("Could not open index file");
     }
 
-    int cols = 2 * this->m + 1;
+    int rowCount = pool ? getRowCount() : this->numberOfRecords;
+    int rowSize = getRowSize();
+    vector<char> rows;
 
-    for (int record = 0; record < this->numberOfRecords; record++) {
-      for (int col = 0; col < cols; col++) {
-        int value;
-        indexFile.read(reinterpret_cast<char *>(&value), sizeof(int));
-        cout << value;
-        if (col < cols - 1) {
-          cout << " ";
+    // Rows are read in chunks of one read each, doubling up to
+    // readAheadRows rows
+    int chunkRows = 1;
+    for (int record = 0; record < rowCount;) {
+      int count = min(chunkRows, rowCount - record);
+      rows.resize((size_t)count * rowSize);
+      indexFile.read(rows.data(), rows.size());
+      int read = indexFile.gcount() / rowSize;
+      for (int i = 0; i < read; i++) {
+        NodeView node(&rows[(size_t)i * rowSize], m);
+        cout << node.nodeType() << " " << node.count() << " " << node.level()
+             << " " << node.nextLeaf();
+        if (node.nodeType() != -1) {
+          for (int j = 0; j < node.count(); j++) {
+            cout << " " << node.key(j) << " " << node.address(j);
+          }
         }
+        cout << endl;
+      }
+      if (read < count) {
+        break;
       }
-      cout << endl;
+      record += count;
+      chunkRows = min(chunkRows * 2, max(readAheadRows, 1));
     }
 
     indexFile.close();
   }
+
+private:
+  int rowSize = 0; // bytes per row
+
+  // Copy-on-write update in progress
+  bool updating = false;
+  int pendingRoot = -1;
+  long long pendingKeys = 0; // changes to the header's key count and height
+  int pendingLevels = 0;
+  unordered_set<int> freshRows; // taken by the update, private to it
+  vector<int> retiredRows;      // replaced by the update, freed on publish
+
+  void checkModes() const {
+    if (useShadowPaging && (useWriteAheadLog || useMemoryMap)) {
+      throw runtime_error("Shadow paging needs the buffered mode and no "
+                          "write-ahead log");
+    }
+    if (deferWrites && (useWriteAheadLog || useShadowPaging)) {
+      throw runtime_error("Deferred writes need no write-ahead log or "
+                          "shadow paging");
+    }
+  }
+
+  void retireRow(int row) {
+    if (find(retiredRows.begin(), retiredRows.end(), row) ==
+        retiredRows.end()) {
+      retiredRows.push_back(row);
+    }
+  }
+
+  // Make the update visible: the new rows reach the file first, then record
+  // 0 with the new root and the free list head in a single write, and only
+  // then are the replaced rows marked free. A crash before the record 0
+  // write leaves the old tree, one after it the new tree; either way at
+  // worst the free list needs the repair done on open. Readers still in the
+  // old tree are waited for, since its replaced rows are about to be freed.
+  void publishUpdate() {
+    lock_guard<mutex> gate(pool->latches().treeGate);
+    lock_guard<shared_mutex> readersOut(pool->latches().tree);
+    int freeHead = getFreeListHead();
+    if (!retiredRows.empty()) {
+      setFreeListHead(retiredRows[0]);
+    }
+    writeField(offsetof(FileHeader, root), pendingRoot);
+    FileHeader *header = reinterpret_cast<FileHeader *>(pool->pin(0));
+    header->keyCount += pendingKeys;
+    header->height += pendingLevels;
+    pool->unpin(0, true);
+    pool->flushBefore(0);
+
+    vector<char> row(getRowSize());
+    for (size_t i = 0; i < retiredRows.size(); i++) {
+      initFreeRow(row.data(),
+                  i + 1 < retiredRows.size() ? retiredRows[i + 1] : freeHead);
+      pool->writeThrough(retiredRows[i], row.data());
+    }
+
+    pool->unpin(0, false);
+    updating = false;
+    freshRows.clear();
+    retiredRows.clear();
+  }
+
+  // Fill in the header fields a file older than the current version lacks
+  // (the root and flags before version 2, the key count and height before
+  // version 3). The entries are counted by walking the tree, since leaf
+  // links may be stale in a shadow-paged file; this happens once per file.
+  // A version 3 file may hold tombstones without the flag saying so.
+  void upgradeHeader() {
+    FileHeader *header = reinterpret_cast<FileHeader *>(pool->pin(0));
+    if (header->version == 3) {
+      header->flags |= indexFileTombstones;
+      header->version = indexFileVersion;
+      pool->unpin(0, true);
+      pool->sync();
+      return;
+    }
+    if (header->version < 2) {
+      header->root = 1;
+      header->flags = 0;
+    }
+    int root = header->root > 0 ? header->root : 1;
+    pool->unpin(0, true);
+
+    long long keys = 0;
+    int height = 0;
+    vector<int> pending(1, root);
+    while (!pending.empty()) {
+      int row = pending.back();
+      pending.pop_back();
+      NodeView node = pinNode(row);
+      if (node.nodeType() == 0) {
+        keys += node.count();
+      } else if (node.nodeType() == 1) {
+        for (int i = 0; i < node.count(); i++) {
+          pending.push_back(node.address(i));
+        }
+      }
+      if (row == root && node.nodeType() != -1) {
+        height = node.level() + 1;
+      }
+      unpinNode(row, false);
+    }
+
+    header = reinterpret_cast<FileHeader *>(pool->pin(0));
+    header->keyCount = keys;
+    header->height = height;
+    header->version = indexFileVersion;
+    pool->unpin(0, true);
+    pool->sync();
+  }
+
+  // A crash during a copy-on-write update can leave the free list running
+  // into rows the update had taken, or into replaced rows not yet marked
+  // free. If following it hits a row that is not free, rebuild it from the
+  // rows the tree does not reach.
+  void repairFreeList() {
+    int rowCount = getRowCount();
+    vector<char> used(rowCount, 0);
+    bool broken = false;
+    for (int row = getFreeListHead(); row != -1;) {
+      if (row <= 0 || row >= rowCount || used[row]) {
+        broken = true;
+        break;
+      }
+      used[row] = 1;
+      NodeView node = pinNode(row);
+      int nodeType = node.nodeType();
+      int next = node.nextLeaf();
+      unpinNode(row, false);
+      if (nodeType != -1) {
+        broken = true;
+        break;
+      }
+      row = next;
+    }
+    if (!broken) {
+      return;
+    }
+
+    fill(used.begin(), used.end(), 0);
+    used[0] = 1;
+    vector<int> pending(1, getRootRow());
+    while (!pending.empty()) {
+      int row = pending.back();
+      pending.pop_back();
+      if (row <= 0 || row >= rowCount || used[row]) {
+        continue;
+      }
+      NodeView node = pinNode(row);
+      if (node.nodeType() != -1) {
+        used[row] = 1;
+      }
+      if (node.nodeType() == 1) {
+        for (int i = 0; i < node.count(); i++) {
+          pending.push_back(node.address(i));
+        }
+      }
+      unpinNode(row, false);
+    }
+
+    int freeHead = -1;
+    for (int row = rowCount - 1; row > 0; row--) {
+      if (!used[row]) {
+        NodeView node = pinNode(row);
+        node.setNodeType(-1);
+        node.setCount(0);
+        node.setLevel(-1);
+        node.setNextLeaf(freeHead);
+        unpinNode(row, true);
+        freeHead = row;
+      }
+    }
+    setFreeListHead(freeHead);
+    pool->flushBefore(0);
+  }
+
+  void setGeometry(char *filename, int numberOfRecords, int m) {
+    this->indexFileName = filename;
+    this->numberOfRecords = numberOfRecords;
+    this->m = m;
+    this->rowSize = rowSizeFor(m, pageSize);
+  }
+
+  void attach(char *filename, int numberOfRecords, int m) {
+    setGeometry(filename, numberOfRecords, m);
+    this->pool = BufferPool::forFile(filename, getRowSize(), bufferPoolFrames,
+                                     useMemoryMap);
+  }
+
+  // Read and check the header of an existing file
+  FileHeader readFileHeader(const char *filename) const {
+    ifstream indexFile(filename, ios::binary);
+    if (!indexFile) {
+      throw runtime_error("Could not open index file");
+    }
+    FileHeader header;
+    if (!indexFile.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        header.magic != indexFileMagic) {
+      throw runtime_error("Not a versioned index file (legacy files can be "
+                          "converted with convertLegacyIndexFile)");
+    }
+    if (header.version > indexFileVersion) {
+      throw runtime_error("Index file version " + to_string(header.version) +
+                          " is newer than this reader");
+    }
+    if (header.version < 2) {
+      header.root = 1;
+      header.flags = 0;
+    }
+    if (header.keySize != sizeof(Key) || header.valueSize != sizeof(Value)) {
+      throw runtime_error("Index file key or address size does not match");
+    }
+    return header;
+  }
+
+  // Format a free row pointing to next in the free list
+  void initFreeRow(char *row, int next) const {
+    memset(row, 0xff, getRowSize());
+    NodeView node(row, m);
+    node.setCount(0);
+    node.setNextLeaf(next);
+  }
 };
 
 /*int main() {
@@ -257,4 +1012,23 @@ runtime_error& e) { cerr << e.what() << endl;
     return 0;
 }*/
 
+template <class Key, class Value>
+inline IndexNode<Key, Value>::IndexNode(
+    long long pos, const IndexFileHandler<Key, Value> *handler) {
+  typedef IndexEntry<Key, Value> Entry;
+  int rowSize = handler->getRowSize();
+  int row = pos / rowSize;
+  const char *slot = handler->pool->pin(row) + pos % rowSize;
+  memcpy(&key, slot + offsetof(Entry, key), sizeof(Key));
+  memcpy(&address, slot + offsetof(Entry, address), sizeof(Value));
+  handler->pool->unpin(row, false);
+  this->pos = pos;
+}
+
+template <class Key, class Value>
+inline IndexNode<Key, Value> IndexNode<Key, Value>::getNextRecord(
+    const IndexFileHandler<Key, Value> *handler) const {
+  return IndexNode(this->pos + sizeof(IndexEntry<Key, Value>), handler);
+}
+
 #endif // INDEX_FILE_HANDLER_CPP
@@ -0,0 +1,217 @@
+#ifndef INDEX_STATS_CPP
+#define INDEX_STATS_CPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+using namespace std;
+
+// Operation and I/O counters of one index file, and a latency histogram for
+// each public call. Kept by the buffer pool, so every handler on the file
+// adds to the same ones (handler.stats()).
+// Only built with INDEX_STATS defined: otherwise the INDEX_COUNT and
+// INDEX_TIMED hooks expand to nothing and every reading stays 0. When
+// built, nothing is recorded until enable() is called, and a hook on a
+// disabled object costs one relaxed load.
+class IndexStats {
+public:
+  enum Counter {
+    inserts,
+    searches,
+    deletes,
+    nodeReads,    // rows read from the file
+    nodeWrites,   // rows written to the file
+    bytesRead,
+    bytesWritten,
+    fileOpens,    // handlers opening or creating the file
+    splits,
+    merges,
+    borrowsLeft,
+    borrowsRight,
+    freeListPops,
+    freeListPushes,
+    cacheHits,    // pins of a row already in a frame
+    cacheMisses,
+    readAheadRows, // rows prefetched ahead of a scan
+    counterCount
+  };
+
+  enum Call {
+    addRecord,
+    searchARecord,
+    searchMany,
+    searchRange,
+    deleteARecord,
+    deleteRange,
+    deleteMany,
+    callCount
+  };
+
+#ifdef INDEX_STATS
+  static const bool compiledIn = true;
+#else
+  static const bool compiledIn = false;
+#endif
+
+  // Latencies in power-of-two buckets: bucket b holds [2^(b-1), 2^b) ns
+  class Histogram {
+  private:
+    static const int bucketCount = 48;
+    atomic<uint64_t> buckets[bucketCount];
+    atomic<uint64_t> samples{0};
+    atomic<uint64_t> totalNanos{0};
+
+  public:
+    Histogram() { reset(); }
+
+    void record(uint64_t nanos) {
+      int bucket = 0;
+      while (bucket < bucketCount - 1 && nanos >> bucket != 0) {
+        bucket++;
+      }
+      buckets[bucket].fetch_add(1, memory_order_relaxed);
+      samples.fetch_add(1, memory_order_relaxed);
+      totalNanos.fetch_add(nanos, memory_order_relaxed);
+    }
+
+    uint64_t count() const { return samples.load(memory_order_relaxed); }
+
+    double meanNanos() const {
+      uint64_t n = count();
+      return n ? (double)totalNanos.load(memory_order_relaxed) / n : 0;
+    }
+
+    // Upper end of the bucket holding quantile q (0.5, 0.99, ...); 0 if
+    // nothing was recorded
+    uint64_t percentile(double q) const {
+      uint64_t n = count();
+      if (n == 0)
+        return 0;
+      uint64_t rank = (uint64_t)(q * n), seen = 0;
+      for (int bucket = 0; bucket < bucketCount; bucket++) {
+        seen += buckets[bucket].load(memory_order_relaxed);
+        if (seen > rank)
+          return (uint64_t)1 << bucket;
+      }
+      return (uint64_t)1 << (bucketCount - 1);
+    }
+
+    void reset() {
+      for (atomic<uint64_t> &bucket : buckets) {
+        bucket.store(0, memory_order_relaxed);
+      }
+      samples.store(0, memory_order_relaxed);
+      totalNanos.store(0, memory_order_relaxed);
+    }
+  };
+
+  // Records the time from its construction to the end of its scope
+  class Timer {
+  private:
+    IndexStats &stats;
+    Call call;
+    bool running;
+    chrono::steady_clock::time_point start;
+
+  public:
+    Timer(IndexStats &stats, Call call)
+        : stats(stats), call(call), running(stats.isEnabled()) {
+      if (running)
+        start = chrono::steady_clock::now();
+    }
+
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+    ~Timer() {
+      if (running) {
+        stats.calls[call].record(
+            chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - start)
+                .count());
+      }
+    }
+  };
+
+private:
+  atomic<bool> enabled{false};
+  atomic<uint64_t> counters[counterCount];
+  Histogram calls[callCount];
+
+public:
+  IndexStats() { reset(); }
+
+  IndexStats(const IndexStats &) = delete;
+  IndexStats &operator=(const IndexStats &) = delete;
+
+  void enable(bool on = true) { enabled.store(on, memory_order_relaxed); }
+
+  bool isEnabled() const { return enabled.load(memory_order_relaxed); }
+
+  void add(Counter counter, uint64_t n) {
+    if (isEnabled())
+      counters[counter].fetch_add(n, memory_order_relaxed);
+  }
+
+  uint64_t get(Counter counter) const {
+    return counters[counter].load(memory_order_relaxed);
+  }
+
+  const Histogram &histogram(Call call) const { return calls[call]; }
+
+  void reset() {
+    for (atomic<uint64_t> &counter : counters) {
+      counter.store(0, memory_order_relaxed);
+    }
+    for (Histogram &histogram : calls) {
+      histogram.reset();
+    }
+  }
+
+  static const char *name(Counter counter) {
+    static const char *const names[counterCount] = {
+        "inserts",      "searches",       "deletes",     "nodeReads",
+        "nodeWrites",   "bytesRead",      "bytesWritten", "fileOpens",
+        "splits",       "merges",         "borrowsLeft", "borrowsRight",
+        "freeListPops", "freeListPushes", "cacheHits",   "cacheMisses",
+        "readAheadRows"};
+    return names[counter];
+  }
+
+  static const char *name(Call call) {
+    static const char *const names[callCount] = {
+        "addRecord", "SearchARecord", "SearchMany", "SearchRange",
+        "DeleteARecord", "DeleteRange", "DeleteMany"};
+    return names[call];
+  }
+
+  // One "name value" line per counter, then one line per call that was
+  // timed: count, mean and p50/p99/p99.9 in nanoseconds
+  void dump(ostream &out) const {
+    for (int counter = 0; counter < counterCount; counter++) {
+      out << name((Counter)counter) << " " << get((Counter)counter) << "\n";
+    }
+    for (int call = 0; call < callCount; call++) {
+      const Histogram &h = calls[call];
+      if (h.count() == 0)
+        continue;
+      out << name((Call)call) << " count " << h.count() << " mean "
+          << (uint64_t)h.meanNanos() << " p50 " << h.percentile(0.5)
+          << " p99 " << h.percentile(0.99) << " p999 "
+          << h.percentile(0.999) << "\n";
+    }
+  }
+};
+
+// Hooks for the index code; nothing is left of them without INDEX_STATS
+#ifdef INDEX_STATS
+#define INDEX_COUNT(stats, counter, n) (stats).add(IndexStats::counter, (n))
+#define INDEX_TIMED(stats, call)                                               \
+  IndexStats::Timer indexStatsTimer((stats), IndexStats::call)
+#else
+#define INDEX_COUNT(stats, counter, n) ((void)0)
+#define INDEX_TIMED(stats, call) ((void)0)
+#endif
+
+#endif // INDEX_STATS_CPP
@@ -0,0 +1,160 @@
+#ifndef IO_URING_CPP
+#define IO_URING_CPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using namespace std;
+
+// Minimal io_uring submission and completion queue for reads, on the raw
+// system calls (no liburing). Reads are queued with queueRead(), handed to
+// the kernel by submit() and collected with nextCompletion(), tagged with
+// the value given when they were queued. One thread uses it at a time.
+class IoUring {
+private:
+  int ringFd = -1;
+  void *sqRing = MAP_FAILED;
+  void *cqRing = MAP_FAILED;
+  size_t sqRingSize = 0;
+  size_t cqRingSize = 0;
+  io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+  size_t sqesSize = 0;
+
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_cqe *cqes;
+  unsigned sqEntries;
+  unsigned queued = 0; // queued since the last submit()
+
+  static unsigned *field(void *ring, unsigned offset) {
+    return reinterpret_cast<unsigned *>(static_cast<char *>(ring) + offset);
+  }
+
+  void release() {
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+      munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+      munmap(sqRing, sqRingSize);
+    if (ringFd != -1)
+      ::close(ringFd);
+  }
+
+public:
+  // Throws if the kernel has no io_uring (or it is not allowed)
+  explicit IoUring(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0) {
+      throw runtime_error("Could not set up io_uring: " +
+                          string(strerror(errno)));
+    }
+    sqEntries = params.sq_entries;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+      sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+    }
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing != MAP_FAILED) {
+      cqRing = singleMap ? sqRing
+                         : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ringFd,
+                                IORING_OFF_CQ_RING);
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    if (cqRing != MAP_FAILED) {
+      sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, ringFd,
+                                  IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED) {
+      int error = errno;
+      release();
+      throw runtime_error("Could not map io_uring: " + string(strerror(error)));
+    }
+
+    sqHead = field(sqRing, params.sq_off.head);
+    sqTail = field(sqRing, params.sq_off.tail);
+    sqMask = field(sqRing, params.sq_off.ring_mask);
+    sqArray = field(sqRing, params.sq_off.array);
+    cqHead = field(cqRing, params.cq_off.head);
+    cqTail = field(cqRing, params.cq_off.tail);
+    cqMask = field(cqRing, params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(cqRing) +
+                                            params.cq_off.cqes);
+  }
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  ~IoUring() { release(); }
+
+  unsigned capacity() const { return sqEntries; }
+
+  // Queue a read of length bytes at offset; false if the queue is full
+  bool queueRead(int fd, void *buffer, unsigned length, long long offset,
+                 uint64_t tag) {
+    unsigned tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+      return false;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe &sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(buffer);
+    sqe.len = length;
+    sqe.off = offset;
+    sqe.user_data = tag;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+    return true;
+  }
+
+  // Hand the queued reads to the kernel and wait until at least waitFor
+  // completions are ready
+  void submit(unsigned waitFor) {
+    while (true) {
+      int done = syscall(__NR_io_uring_enter, ringFd, queued, waitFor,
+                         waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if (done >= 0) {
+        queued -= min<unsigned>(done, queued);
+        if (queued == 0 || waitFor > 0)
+          return;
+        continue;
+      }
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        throw runtime_error("Could not submit to io_uring: " +
+                            string(strerror(errno)));
+      }
+    }
+  }
+
+  // Take one completion: its tag and result (bytes read, or -errno); false
+  // if none is ready
+  bool nextCompletion(uint64_t &tag, int &result) {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+      return false;
+    const io_uring_cqe &cqe = cqes[head & *cqMask];
+    tag = cqe.user_data;
+    result = cqe.res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+};
+
+#endif // IO_URING_CPP
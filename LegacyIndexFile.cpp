@@ -0,0 +1,97 @@
+#ifndef LEGACY_INDEX_FILE_CPP
+#define LEGACY_INDEX_FILE_CPP
+
+#include "BulkLoader.cpp"
+#include <algorithm>
+#include <fstream>
+#include <vector>
+using namespace std;
+
+// Index files written before the versioned format have no file header:
+// every row is 2*m+1 ints [nodeType, key1, addr1, ..., keyM, addrM] with
+// unused slots set to -1, record 0 keeps the free list head in its second
+// int and leaves are not linked. m is not stored, so the caller supplies it.
+// The root is record 1, and an internal row's addresses are the records of
+// its children.
+
+// Rebuild a legacy file as a versioned index in newFilename. The tree is
+// walked from record 1, since the legacy code could leave rows typed as
+// leaves that no node points to any more, and the entries of the leaves it
+// reaches are sorted, then bulk loaded, so the new tree is balanced and its
+// leaves linked whatever shape the old one had; a key found twice makes the
+// conversion fail rather than pick one. The new file has the handler's
+// default page size; newM = 0 fills each node to one page.
+inline void convertLegacyIndexFile(char *legacyFilename, int legacyM,
+                                   char *newFilename, int newM = 0,
+                                   double fillFactor = 1.0) {
+  ifstream legacy(legacyFilename, ios::binary);
+  if (!legacy) {
+    throw runtime_error("Could not open legacy index file");
+  }
+
+  int cols = 2 * legacyM + 1;
+  vector<int> rows;
+  vector<int> row(cols);
+  while (legacy.read(reinterpret_cast<char *>(row.data()), cols * sizeof(int))) {
+    rows.insert(rows.end(), row.begin(), row.end());
+  }
+  int rowCount = rows.size() / cols;
+
+  vector<IndexEntry<int, int>> entries;
+  vector<char> visited(rowCount, 0);
+  vector<int> pending(rowCount > 1 ? 1 : 0, 1);
+  while (!pending.empty()) {
+    int record = pending.back();
+    pending.pop_back();
+    if (record <= 0 || record >= rowCount) {
+      throw runtime_error("Legacy index file has a bad child record " +
+                          to_string(record));
+    }
+    // The legacy code could leave a child in its parent twice
+    if (visited[record]) {
+      continue;
+    }
+    visited[record] = 1;
+    const int *node = &rows[(size_t)record * cols];
+    // A free root (nodeType -1) is an empty index
+    if (node[0] != 0 && node[0] != 1) {
+      continue;
+    }
+    for (int i = 0; i < legacyM; i++) {
+      if (node[1 + 2 * i] == -1) {
+        continue;
+      }
+      if (node[0] == 0) {
+        entries.push_back({node[1 + 2 * i], node[2 + 2 * i]});
+      } else {
+        pending.push_back(node[2 + 2 * i]);
+      }
+    }
+  }
+  sort(entries.begin(), entries.end(),
+       [](const IndexEntry<int, int> &a, const IndexEntry<int, int> &b) {
+         return a.key < b.key;
+       });
+  for (size_t i = 1; i < entries.size(); i++) {
+    if (entries[i].key == entries[i - 1].key) {
+      throw runtime_error("Legacy index file has key " +
+                          to_string(entries[i].key) + " in more than one leaf");
+    }
+  }
+
+  // Rows are added by the loader as it needs them
+  const int initialRows = 16;
+  IndexFileHandler<> handler;
+  if (newM == 0) {
+    newM = IndexFileHandler<>::orderForPageSize(handler.pageSize);
+  }
+  handler.createIndexFile(newFilename, initialRows, newM);
+
+  BulkLoader<> loader(newM, initialRows, newFilename, fillFactor);
+  for (const IndexEntry<int, int> &entry : entries) {
+    loader.add(entry.key, entry.address);
+  }
+  loader.finish();
+}
+
+#endif // LEGACY_INDEX_FILE_CPP
@@ -0,0 +1,142 @@
+#ifndef MAPPED_FILE_CPP
+#define MAPPED_FILE_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+// Shared read/write mapping of the whole index file. Rows are addressed in
+// place; changes reach the file through msync at commit points.
+class MappedFile {
+private:
+  // One mapping of the file; never changed once published
+  struct Region {
+    char *base;
+    size_t length;
+  };
+
+  string fileName;
+  int rowSize; // bytes per row
+  int fd = -1;
+  atomic<Region *> current{nullptr};
+  vector<Region *> retired; // earlier, smaller mappings
+
+  Region *ensureMapped() {
+    Region *region = current.load(memory_order_acquire);
+    if (region != nullptr)
+      return region;
+    if (fd == -1) {
+      fd = ::open(fileName.c_str(), O_RDWR);
+      if (fd == -1) {
+        throw runtime_error("Could not open index file: " +
+                            string(strerror(errno)));
+      }
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+      throw runtime_error("Could not map empty index file");
+    }
+    void *addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (addr == MAP_FAILED) {
+      throw runtime_error("Could not map index file: " +
+                          string(strerror(errno)));
+    }
+    region = new Region{static_cast<char *>(addr), (size_t)st.st_size};
+    current.store(region, memory_order_release);
+    return region;
+  }
+
+  char *rowIn(const Region *region, int row) const {
+    if (row < 0 || (size_t)(row + 1) * rowSize > region->length)
+      return nullptr;
+    return region->base + (size_t)row * rowSize;
+  }
+
+public:
+  MappedFile(const char *fileName, int rowSize)
+      : fileName(fileName), rowSize(rowSize) {}
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    unmap();
+    for (Region *region : retired) {
+      munmap(region->base, region->length);
+      delete region;
+    }
+    if (fd != -1)
+      ::close(fd);
+  }
+
+  // Drop the mapping; the next access maps the file again at its new size
+  void unmap() {
+    Region *region = current.exchange(nullptr);
+    if (region != nullptr) {
+      munmap(region->base, region->length);
+      delete region;
+    }
+  }
+
+  // Map the file again at its new size on the next access. Rows pinned by
+  // other threads stay valid: the old mapping is kept until the file is
+  // closed, and both map the same pages.
+  void remap() {
+    Region *region = current.exchange(nullptr);
+    if (region != nullptr) {
+      retired.push_back(region);
+    }
+  }
+
+  int rowCount() { return ensureMapped()->length / rowSize; }
+
+  // Address of a row inside the mapping, nullptr past the end of the file
+  char *rowData(int row) { return rowIn(ensureMapped(), row); }
+
+  // Like rowData, but safe to call while another thread maps the file:
+  // nullptr also when it is not mapped at the moment
+  char *peekRow(int row) const {
+    Region *region = current.load(memory_order_acquire);
+    return region != nullptr ? rowIn(region, row) : nullptr;
+  }
+
+  // Ask the kernel to start reading count rows from firstRow into the
+  // mapping; only a hint, so a failure is ignored
+  void prefetch(int firstRow, int count) {
+    Region *region = ensureMapped();
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)max(firstRow, 0) * rowSize / pageSize * pageSize;
+    size_t end = min(region->length, (size_t)(firstRow + count) * rowSize);
+    if (start < end) {
+      madvise(region->base + start, end - start, MADV_WILLNEED);
+    }
+  }
+
+  // Write rows [firstRow, lastRow] through to the file; with wait, return
+  // once they are on disk, otherwise once the writes are started. Rows
+  // changed through an older mapping are the same pages, so they are
+  // included.
+  void sync(int firstRow, int lastRow, bool wait) {
+    Region *region = ensureMapped();
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)firstRow * rowSize / pageSize * pageSize;
+    size_t end = min(region->length, (size_t)(lastRow + 1) * rowSize);
+    if (msync(region->base + start, end - start,
+              wait ? MS_SYNC : MS_ASYNC) == -1) {
+      throw runtime_error("Could not sync index file: " +
+                          string(strerror(errno)));
+    }
+  }
+};
+
+#endif // MAPPED_FILE_CPP
@@ -0,0 +1,109 @@
+#ifndef NODE_FILE_CPP
+#define NODE_FILE_CPP
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+using namespace std;
+
+// Whole-row I/O on the index file. The descriptor is opened on first use
+// and kept for the lifetime of the object; every row moves with a single
+// pread/pwrite at its offset.
+class NodeFile {
+private:
+  string fileName;
+  int rowSize; // bytes per row
+  int fd = -1;
+
+  void ensureOpen() {
+    if (fd != -1)
+      return;
+    fd = ::open(fileName.c_str(), O_RDWR);
+    if (fd == -1) {
+      throw runtime_error("Could not open index file: " +
+                          string(strerror(errno)));
+    }
+  }
+
+public:
+  NodeFile(const char *fileName, int rowSize)
+      : fileName(fileName), rowSize(rowSize) {}
+
+  NodeFile(const NodeFile &) = delete;
+  NodeFile &operator=(const NodeFile &) = delete;
+
+  ~NodeFile() { close(); }
+
+  void close() {
+    if (fd != -1) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  int getRowSize() const { return rowSize; }
+
+  // Read one row; the part past the end of the file reads as -1 fields
+  void readRow(int row, char *dst) {
+    ensureOpen();
+    off_t offset = (off_t)row * rowSize;
+    ssize_t done = 0;
+    while (done < rowSize) {
+      ssize_t n = ::pread(fd, dst + done, rowSize - done, offset + done);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        throw runtime_error("Could not read index row: " +
+                            string(strerror(errno)));
+      }
+      if (n == 0)
+        break;
+      done += n;
+    }
+    memset(dst + done, 0xff, rowSize - done);
+  }
+
+  void writeRow(int row, const char *src) { writeRows(row, 1, src); }
+
+  // Write count consecutive rows starting at row in one call; writing past
+  // the end of the file extends it
+  void writeRows(int row, int count, const char *src) {
+    ensureOpen();
+    off_t offset = (off_t)row * rowSize;
+    size_t length = (size_t)count * rowSize;
+    size_t done = 0;
+    while (done < length) {
+      ssize_t n = ::pwrite(fd, src + done, length - done, offset + done);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        throw runtime_error("Could not write index row: " +
+                            string(strerror(errno)));
+      }
+      done += n;
+    }
+  }
+
+  // Ask the kernel to start reading count rows from row into its cache;
+  // only a hint, so a failure is ignored
+  void prefetch(int row, int count) {
+    ensureOpen();
+    ::posix_fadvise(fd, (off_t)row * rowSize, (off_t)count * rowSize,
+                    POSIX_FADV_WILLNEED);
+  }
+
+  // Make the rows written so far durable
+  void sync() {
+    ensureOpen();
+    if (::fdatasync(fd) == -1) {
+      throw runtime_error("Could not sync index file: " +
+                          string(strerror(errno)));
+    }
+  }
+};
+
+#endif // NODE_FILE_CPP
@@ -0,0 +1,152 @@
+#ifndef NODE_LATCHES_CPP
+#define NODE_LATCHES_CPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+using namespace std;
+
+// Latches of one index file, shared by every handler on it through the
+// buffer pool.
+// Each row has a reader/writer latch of one 64-bit word: the low 31 bits
+// count readers, bit 31 is set by a writer and the high half is the row's
+// version, bumped every time the row is changed. A writer sets its bit
+// first and then waits for the readers inside to leave, so a stream of
+// readers cannot starve it. Latches are held for one node visit or one
+// update, so waiting spins for a while and then yields. They are
+// allocated in chunks as rows are first latched.
+// Optimistic readers take no latch at all: they stamp() a row, read it
+// and validate() the stamp, which fails if a writer held or changed the
+// row in between.
+class NodeLatches {
+private:
+  static const uint64_t readerMask = (1u << 31) - 1;
+  static const uint64_t writerBit = 1u << 31;
+  static const uint64_t versionOne = 1ULL << 32;
+  static const int chunkBits = 16; // 64K latches per chunk
+  static const int maxChunks = 1 << 15;
+
+  atomic<atomic<uint64_t> *> chunks[maxChunks];
+
+  atomic<uint64_t> &word(int row) {
+    if (row < 0) {
+      throw runtime_error("Latch of a row outside the index file");
+    }
+    atomic<atomic<uint64_t> *> &slot = chunks[row >> chunkBits];
+    atomic<uint64_t> *chunk = slot.load(memory_order_acquire);
+    if (chunk == nullptr) {
+      atomic<uint64_t> *fresh = new atomic<uint64_t>[1 << chunkBits]();
+      if (slot.compare_exchange_strong(chunk, fresh, memory_order_acq_rel)) {
+        chunk = fresh;
+      } else {
+        delete[] fresh;
+      }
+    }
+    return chunk[row & ((1 << chunkBits) - 1)];
+  }
+
+  // Add a reader unless a writer holds or waits for the latch
+  static bool tryLockWord(atomic<uint64_t> &latch) {
+    uint64_t value = latch.load(memory_order_relaxed);
+    while (!(value & writerBit)) {
+      if (latch.compare_exchange_weak(value, value + 1,
+                                      memory_order_acquire)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void backOff(int &spins) {
+    if (++spins > 64) {
+      this_thread::yield();
+    }
+  }
+
+public:
+  // Writers take turns on this where one flush covers every change made
+  // since the last (write-ahead log, shadow paging)
+  mutex writer;
+  // Record 0's free list head and row count
+  mutex freeList;
+  // With shadow paging: held shared by readers of the published tree and
+  // exclusively while an update is published. The publisher holds
+  // treeGate while it waits, and new readers pass through treeGate first,
+  // so they cannot starve it.
+  shared_mutex tree;
+  mutex treeGate;
+
+  NodeLatches() {
+    for (atomic<atomic<uint64_t> *> &chunk : chunks) {
+      chunk.store(nullptr, memory_order_relaxed);
+    }
+  }
+
+  NodeLatches(const NodeLatches &) = delete;
+  NodeLatches &operator=(const NodeLatches &) = delete;
+
+  ~NodeLatches() {
+    for (atomic<atomic<uint64_t> *> &chunk : chunks) {
+      delete[] chunk.load(memory_order_relaxed);
+    }
+  }
+
+  void lockShared(int row) {
+    atomic<uint64_t> &latch = word(row);
+    int spins = 0;
+    while (!tryLockWord(latch)) {
+      backOff(spins);
+    }
+  }
+
+  // Take the shared latch only if that needs no waiting
+  bool tryLockShared(int row) { return tryLockWord(word(row)); }
+
+  void unlockShared(int row) {
+    word(row).fetch_sub(1, memory_order_release);
+  }
+
+  void lock(int row) {
+    atomic<uint64_t> &latch = word(row);
+    int spins = 0;
+    uint64_t value = latch.load(memory_order_relaxed);
+    while ((value & writerBit) ||
+           !latch.compare_exchange_weak(value, value | writerBit,
+                                        memory_order_acquire)) {
+      backOff(spins);
+      value = latch.load(memory_order_relaxed);
+    }
+    while (latch.load(memory_order_acquire) & readerMask) {
+      backOff(spins);
+    }
+  }
+
+  void unlock(int row) {
+    word(row).fetch_and(~writerBit, memory_order_release);
+  }
+
+  // The row was changed (called before its writer releases it)
+  void changed(int row) {
+    word(row).fetch_add(versionOne, memory_order_release);
+  }
+
+  // Version of a row before an optimistic read; false while a writer
+  // holds it, since the row may be half changed
+  bool stamp(int row, uint64_t &version) {
+    uint64_t value = word(row).load(memory_order_acquire);
+    version = value & ~readerMask;
+    return !(value & writerBit);
+  }
+
+  // True if the row is as it was when stamped, so what was read from it
+  // in between is consistent
+  bool validate(int row, uint64_t version) {
+    atomic_thread_fence(memory_order_acquire);
+    return (word(row).load(memory_order_relaxed) & ~readerMask) == version;
+  }
+};
+
+#endif // NODE_LATCHES_CPP
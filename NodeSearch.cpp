@@ -0,0 +1,120 @@
+#ifndef NODE_SEARCH_CPP
+#define NODE_SEARCH_CPP
+
+// In-node key search. Entries are sorted (key, address) pairs.
+// For int keys with int addresses the keys sit in every other int, so the
+// vector paths de-interleave a block of entries into one register of keys
+// before comparing. The AVX2 path is chosen at run time when the CPU has
+// it; x86-64 always has SSE2; other targets use the scalar loop. Other key
+// types are binary searched.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NODE_SEARCH_X86 1
+#include <immintrin.h>
+#endif
+
+// The int kernels take keys[2 * i] as the key of entry i
+
+// Keys of the first count entries that are < key (entries are sorted)
+static inline int nodeLowerBoundScalar(const int *keys, int from, int count,
+                                       int key) {
+  int i = from;
+  while (i < count && keys[2 * i] < key)
+    i++;
+  return i;
+}
+
+#ifdef NODE_SEARCH_X86
+
+// Keys of entries i..i+3 in one register
+static inline __m128i loadKeys4(const int *keys, int i) {
+  __m128 lo = _mm_loadu_ps(reinterpret_cast<const float *>(keys + 2 * i));
+  __m128 hi = _mm_loadu_ps(reinterpret_cast<const float *>(keys + 4 + 2 * i));
+  return _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+static inline int nodeLowerBoundSSE2(const int *keys, int count, int key) {
+  __m128i target = _mm_set1_epi32(key);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    int less = _mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmplt_epi32(loadKeys4(keys, i), target)));
+    if (less != 0xf)
+      return i + __builtin_popcount(less);
+  }
+  return nodeLowerBoundScalar(keys, i, count, key);
+}
+
+// Keys of entries i..i+7 in one register, in order
+__attribute__((target("avx2"))) static inline __m256i
+loadKeys8(const int *keys, int i) {
+  __m256 lo = _mm256_loadu_ps(reinterpret_cast<const float *>(keys + 2 * i));
+  __m256 hi =
+      _mm256_loadu_ps(reinterpret_cast<const float *>(keys + 8 + 2 * i));
+  // Per 128-bit lane: k0 k1 k4 k5 | k2 k3 k6 k7, then fix the lane order
+  __m256 packed = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+  return _mm256_permute4x64_epi64(_mm256_castps_si256(packed),
+                                  _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("avx2"))) static int
+nodeLowerBoundAVX2(const int *keys, int count, int key) {
+  __m256i target = _mm256_set1_epi32(key);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    int less = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpgt_epi32(target, loadKeys8(keys, i))));
+    if (less != 0xff)
+      return i + __builtin_popcount(less);
+  }
+  return nodeLowerBoundSSE2(keys + 2 * i, count - i, key) + i;
+}
+
+static inline bool cpuHasAVX2() {
+  static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+  return hasAVX2;
+}
+
+#endif // NODE_SEARCH_X86
+
+// Index of the first of the first count keys that is >= key (count if none)
+inline int nodeLowerBoundInt32(const int *keys, int count, int key) {
+#ifdef NODE_SEARCH_X86
+  if (cpuHasAVX2())
+    return nodeLowerBoundAVX2(keys, count, key);
+  return nodeLowerBoundSSE2(keys, count, key);
+#else
+  return nodeLowerBoundScalar(keys, 0, count, key);
+#endif
+}
+
+// Same for entries of any key type: first of the first count entries with
+// a key >= key
+template <class Entry, class Key>
+inline int nodeLowerBound(const Entry *entries, int count, const Key &key) {
+  int low = 0, high = count;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (entries[mid].key < key)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+// First of the first count entries with a key > key
+template <class Entry, class Key>
+inline int nodeUpperBound(const Entry *entries, int count, const Key &key) {
+  int low = 0, high = count;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (key < entries[mid].key)
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  return low;
+}
+
+#endif // NODE_SEARCH_CPP
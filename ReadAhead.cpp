@@ -0,0 +1,45 @@
+#ifndef READ_AHEAD_CPP
+#define READ_AHEAD_CPP
+
+#include <algorithm>
+using namespace std;
+
+// Read-ahead window of one scan. It is told every row the scan moves to;
+// while those rows follow each other in the file it names the rows ahead
+// of the scan to prefetch, and the window doubles (up to maxRows) each
+// time the scan gets within half a window of the end of what was
+// prefetched. A jump anywhere else closes it again.
+class ReadAhead {
+private:
+  int maxRows;
+  int window = 0;         // rows ahead of the scan, 0 while not sequential
+  int nextRow = -1;       // row continuing the run
+  int prefetchedEnd = -1; // first row past the ones prefetched
+
+public:
+  static constexpr int minRows = 4;
+
+  explicit ReadAhead(int maxRows) : maxRows(maxRows) {}
+
+  // The scan moved to row. True if [first, first + count) should be
+  // prefetched now.
+  bool next(int row, int &first, int &count) {
+    bool sequential = row == nextRow;
+    nextRow = row + 1;
+    if (!sequential || maxRows <= 0) {
+      window = 0;
+      prefetchedEnd = row + 1;
+      return false;
+    }
+    if (window > 0 && prefetchedEnd - row > window / 2) {
+      return false;
+    }
+    window = window == 0 ? min(minRows, maxRows) : min(window * 2, maxRows);
+    first = max(prefetchedEnd, row + 1);
+    count = row + 1 + window - first;
+    prefetchedEnd = first + max(count, 0);
+    return count > 0;
+  }
+};
+
+#endif // READ_AHEAD_CPP
@@ -0,0 +1,199 @@
+#ifndef WRITE_AHEAD_LOG_CPP
+#define WRITE_AHEAD_LOG_CPP
+
+#include "NodeFile.cpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// Redo log kept next to an index file (<index>.wal). Each commit is one
+// record holding the new image of every row an operation changed:
+//   [magic, rows, rowSize, checksum | row number, row bytes, ...]
+// Commits are gathered in memory and sync() writes them with a single
+// append and fdatasync, so a group of commits costs one sequential write.
+// On replay a record that is cut short or fails its checksum (the tail of
+// an interrupted append) ends the log.
+class WriteAheadLog {
+private:
+  struct RecordHeader {
+    uint32_t magic;
+    uint32_t rows;
+    uint32_t rowSize;
+    uint32_t checksum; // of everything after the header
+  };
+
+  static const uint32_t recordMagic = 0x52444F4C; // "LODR"
+
+  string fileName;
+  int rowSize; // bytes per row
+  int fd = -1;
+  vector<char> pending; // records not written yet
+  int pendingCommits = 0;
+  long long size = 0; // bytes written to the file
+
+  static uint32_t checksum(const char *data, size_t length) {
+    // FNV-1a over 8-byte words
+    uint64_t hash = 1469598103934665603ULL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+      uint64_t word;
+      memcpy(&word, data + i, 8);
+      hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < length; i++) {
+      hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+  }
+
+  // Read up to length bytes at offset; fewer only at the end of the file
+  size_t readAt(long long offset, char *dst, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+      ssize_t n = ::pread(fd, dst + done, length - done, offset + done);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        throw runtime_error("Could not read write-ahead log: " +
+                            string(strerror(errno)));
+      }
+      if (n == 0)
+        break;
+      done += n;
+    }
+    return done;
+  }
+
+public:
+  WriteAheadLog(const string &fileName, int rowSize)
+      : fileName(fileName), rowSize(rowSize) {
+    fd = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+      throw runtime_error("Could not open write-ahead log: " +
+                          string(strerror(errno)));
+    }
+    size = ::lseek(fd, 0, SEEK_END);
+  }
+
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+  ~WriteAheadLog() {
+    if (fd != -1) {
+      ::close(fd);
+    }
+  }
+
+  static string fileFor(const string &indexFileName) {
+    return indexFileName + ".wal";
+  }
+
+  long long getSize() const { return size; }
+
+  int getPendingCommits() const { return pendingCommits; }
+
+  // Queue one atomic record with the images of the given rows
+  void commit(const vector<pair<int, const char *>> &rows) {
+    size_t start = pending.size();
+    size_t bodySize = rows.size() * (sizeof(int32_t) + rowSize);
+    pending.resize(start + sizeof(RecordHeader) + bodySize);
+
+    char *body = &pending[start + sizeof(RecordHeader)];
+    char *out = body;
+    for (const pair<int, const char *> &row : rows) {
+      int32_t number = row.first;
+      memcpy(out, &number, sizeof(number));
+      memcpy(out + sizeof(number), row.second, rowSize);
+      out += sizeof(number) + rowSize;
+    }
+
+    RecordHeader header;
+    header.magic = recordMagic;
+    header.rows = rows.size();
+    header.rowSize = rowSize;
+    header.checksum = checksum(body, bodySize);
+    memcpy(&pending[start], &header, sizeof(header));
+    pendingCommits++;
+  }
+
+  // Append the queued records and make them durable
+  void sync() {
+    if (pending.empty())
+      return;
+    size_t done = 0;
+    while (done < pending.size()) {
+      ssize_t n = ::write(fd, pending.data() + done, pending.size() - done);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        throw runtime_error("Could not write write-ahead log: " +
+                            string(strerror(errno)));
+      }
+      done += n;
+    }
+    if (::fdatasync(fd) == -1) {
+      throw runtime_error("Could not sync write-ahead log: " +
+                          string(strerror(errno)));
+    }
+    size += pending.size();
+    pending.clear();
+    pendingCommits = 0;
+  }
+
+  // Forget queued records (the index file was recreated)
+  void discardPending() {
+    pending.clear();
+    pendingCommits = 0;
+  }
+
+  // Empty the log once the index file holds everything in it
+  void truncate() {
+    if (::ftruncate(fd, 0) == -1) {
+      throw runtime_error("Could not truncate write-ahead log: " +
+                          string(strerror(errno)));
+    }
+    size = 0;
+  }
+
+  // Write the rows of every complete record to file, oldest first, and
+  // return the number of records applied
+  int replay(NodeFile &file) {
+    int applied = 0;
+    long long offset = 0;
+    vector<char> body;
+    while (true) {
+      RecordHeader header;
+      if (readAt(offset, reinterpret_cast<char *>(&header), sizeof(header)) <
+              sizeof(header) ||
+          header.magic != recordMagic || header.rowSize != (uint32_t)rowSize) {
+        break;
+      }
+      size_t bodySize = (size_t)header.rows * (sizeof(int32_t) + rowSize);
+      body.resize(bodySize);
+      if (readAt(offset + sizeof(header), body.data(), bodySize) < bodySize ||
+          checksum(body.data(), bodySize) != header.checksum) {
+        break;
+      }
+
+      const char *in = body.data();
+      for (uint32_t i = 0; i < header.rows; i++) {
+        int32_t number;
+        memcpy(&number, in, sizeof(number));
+        file.writeRow(number, in + sizeof(number));
+        in += sizeof(number) + rowSize;
+      }
+      offset += sizeof(header) + bodySize;
+      applied++;
+    }
+    return applied;
+  }
+};
+
+#endif // WRITE_AHEAD_LOG_CPP
@@ -5,228 +5,237 @@
 #include "IndexFileHandler.cpp"
 #include <vector>
 #include <algorithm>
+#include <mutex>
 
-class BTreeAddition : public IndexFileHandler {
-private:
-    int m; // B-tree order
-    int numberOfRecords;
-    char *filename;
+template <class Key = int, class Value = int>
+class BTreeAddition : public IndexFileHandler<Key, Value> {
+public:
+    // Members of the dependent base, as in a non-template subclass
+    typedef ::IndexFileHandler<Key, Value> IndexFileHandler;
+    typedef typename IndexFileHandler::NodeView NodeView;
+    typedef typename IndexFileHandler::Entry Entry;
+    using IndexFileHandler::m;
+    using IndexFileHandler::pool;
+    using IndexFileHandler::pinNode;
+    using IndexFileHandler::unpinNode;
+    using IndexFileHandler::latchNode;
+    using IndexFileHandler::unlatchNodes;
+    using IndexFileHandler::latchRoot;
+    using IndexFileHandler::writerTurn;
+    using IndexFileHandler::openIndexFile;
+    using IndexFileHandler::getRootRow;
+    using IndexFileHandler::setRootRow;
+    using IndexFileHandler::beginUpdate;
+    using IndexFileHandler::shadowRow;
+    using IndexFileHandler::takeFreeRow;
+    using IndexFileHandler::changeTreeSize;
+    using IndexFileHandler::lazyDeletes;
+    using IndexFileHandler::hasTombstones;
+    using IndexFileHandler::isTombstone;
+    using IndexFileHandler::flush;
+    using IndexFileHandler::flushOperation;
+    using IndexFileHandler::stats;
 
+private:
     struct Record {
-        int key;
-        int address;
+        Key key;
+        Value address;
 
-        Record(int k = -1, int addr = -1) : key(k), address(addr) {}
+        Record() : key(), address(static_cast<Value>(-1)) {}
+        Record(const Key& k, Value addr) : key(k), address(addr) {}
     };
 
     struct Node {
         int nodeType; // 1 = internal, 0 = leaf
+        int level; // 0 = leaf, children are one level lower
         int nextEmpty; // for free list
+        int nextLeaf; // next leaf in key order, leaves only
         vector<Record> records;
 
-        Node() : nodeType(-1), nextEmpty(-1) {}
+        Node() : nodeType(-1), level(-1), nextEmpty(-1), nextLeaf(-1) {}
     };
 
-    // Read a node from file
+    // Read a node through the buffer pool
     Node readNode(int rowNum) {
-        ifstream file(filename, ios::binary);
-        if (!file) {
-            throw runtime_error("Could not open file for reading");
-        }
-
         Node node;
-        int cols = 2 * m + 1;
-
-        // Seek to the row
-        file.seekg(rowNum * cols * sizeof(int), ios::beg);
+        NodeView row = pinNode(rowNum);
 
-        // Read node type (column 0)
-        file.read(reinterpret_cast<char*>(&node.nodeType), sizeof(int));
+        // Read node type
+        node.nodeType = row.nodeType();
 
-        // For empty rows (nodeType=-1), column 1 is nextEmpty pointer
+        // For empty rows (nodeType=-1), next is the nextEmpty pointer
         if (node.nodeType == -1) {
-            file.read(reinterpret_cast<char*>(&node.nextEmpty), sizeof(int));
-            // Skip reading records for empty rows
-            file.close();
+            node.nextEmpty = row.nextLeaf();
+            unpinNode(rowNum, false);
             return node;
         }
 
-        // For data nodes (type 0 or 1), records start from column 1
+        // For data nodes (type 0 or 1), read the entries in use
         node.nextEmpty = -1;
-
-        // Read records (key, address pairs) - starting from column 1
-        for (int i = 0; i < m; i++) {
-            int key, addr;
-            file.read(reinterpret_cast<char*>(&key), sizeof(int));
-            file.read(reinterpret_cast<char*>(&addr), sizeof(int));
-
-            if (key != -1) {
-                node.records.push_back(Record(key, addr));
-            }
+        node.level = row.level();
+        node.nextLeaf = row.nextLeaf();
+        for (int i = 0; i < row.count(); i++) {
+            node.records.push_back(Record(row.key(i), row.address(i)));
         }
 
-        file.close();
+        unpinNode(rowNum, false);
         return node;
     }
 
-    // Write a node to file
+    // Write a node through the buffer pool
     void writeNode(int rowNum, const Node& node) {
-        fstream file(filename, ios::binary | ios::in | ios::out);
-        if (!file) {
-            throw runtime_error("Could not open file for writing");
-        }
-
-        int cols = 2 * m + 1;
+        NodeView row = pinNode(rowNum);
 
-        // Seek to the row
-        file.seekp(rowNum * cols * sizeof(int), ios::beg);
+        // Write node type
+        row.setNodeType(node.nodeType);
 
-        // Write node type (column 0)
-        file.write(reinterpret_cast<const char*>(&node.nodeType), sizeof(int));
-
-        // For empty rows (nodeType=-1), write nextEmpty in column 1
+        // For empty rows (nodeType=-1), write nextEmpty as next
         if (node.nodeType == -1) {
-            file.write(reinterpret_cast<const char*>(&node.nextEmpty), sizeof(int));
-            // Fill rest with -1
-            for (int i = 2; i < cols; i++) {
-                int value = -1;
-                file.write(reinterpret_cast<const char*>(&value), sizeof(int));
-            }
-            file.close();
+            row.setCount(0);
+            row.setLevel(-1);
+            row.setNextLeaf(node.nextEmpty);
+            unpinNode(rowNum, true);
             return;
         }
 
-        // For data nodes (type 0 or 1), write records starting from column 1
-        int recordIdx = 0;
-        for (int i = 0; i < m; i++) {
-            int key = -1, addr = -1;
-            if (recordIdx < node.records.size()) {
-                key = node.records[recordIdx].key;
-                addr = node.records[recordIdx].address;
-                recordIdx++;
-            }
-            file.write(reinterpret_cast<const char*>(&key), sizeof(int));
-            file.write(reinterpret_cast<const char*>(&addr), sizeof(int));
+        // For data nodes (type 0 or 1), write the records and their count
+        for (size_t i = 0; i < node.records.size(); i++) {
+            row.set(i, node.records[i].key, node.records[i].address);
         }
+        row.setCount(node.records.size());
+        row.setLevel(node.level);
+        row.setNextLeaf(node.nextLeaf);
 
-        file.close();
+        unpinNode(rowNum, true);
     }
 
-    // Find the correct position for insertion
-    int findInsertPosition(int key, int currentRow) {
-        Node node = readNode(currentRow);
-
-        // If leaf node (0), we found where to insert
-        if (node.nodeType == 0) {
-            return currentRow;
-        }
+    // Entry taken on the way down: the internal node's row and the slot of
+    // the child that was followed
+    struct PathEntry {
+        int row;
+        int slot;
+    };
 
-        // Internal node (1), navigate to child
-        for (int i = 0; i < node.records.size(); i++) {
-            if (key < node.records[i].key) {
-                return findInsertPosition(key, node.records[i].address);
+    // Find the correct position for insertion, recording the root-to-leaf
+    // path so that splits can walk back up it. currentRow is latched; each
+    // child is latched exclusively before moving down, and once a node has
+    // room (no split can reach its parent) the ones above it are released
+    // and dropped from the path. The ones still held are left in latched.
+    int findInsertPosition(const Key& key, int currentRow, vector<PathEntry>& path, vector<int>& latched) {
+        while (true) {
+            // Scan the node in place instead of copying it into a Node
+            NodeView node = pinNode(currentRow);
+
+            // A node with room cannot split, so nothing above it changes
+            if (node.count() < m && latched.size() > 1) {
+                unlatchNodes(latched, true, 1);
+                path.clear();
             }
-        }
-
-        // Key is larger than all, go to rightmost child
-        if (node.records.size() > 0) {
-            return findInsertPosition(key, node.records.back().address);
-        }
-
-        return currentRow;
-    }
-
-    // Insert into a node and handle splits
-    bool insertIntoNode(int rowNum, int key, int address, int& promotedKey, int& newChildRow) {
-        Node node = readNode(rowNum);
 
-        // Check if node is already full BEFORE inserting
-        // A node can hold m records maximum
-        if (node.records.size() >= m) {
-            // Node is full, need to split
-            // First, insert the new record temporarily
-            node.records.push_back(Record(key, address));
-            sort(node.records.begin(), node.records.end(),
-                 [](const Record& a, const Record& b) { return a.key < b.key; });
-
-            // Now split (we have m+1 records total)
-            int medianIdx = (node.records.size()) / 2;
-
-            // For parent: use LARGEST key from LEFT child
-            promotedKey = node.records[medianIdx - 1].key;
-
-            // Create new node for right half (same type as original)
-            Node newNode;
-            newNode.nodeType = node.nodeType;
-            newNode.nextEmpty = -1;
-
-            // Right half goes to new node (starts from median)
-            for (int i = medianIdx; i < node.records.size(); i++) {
-                newNode.records.push_back(node.records[i]);
+            // If leaf node (0), we found where to insert
+            if (node.nodeType() == 0) {
+                unpinNode(currentRow, false);
+                return currentRow;
             }
 
-            // Left half stays in current node (everything before median)
-            node.records.resize(medianIdx);
-
-            // Find empty row for new node
-            newChildRow = findEmptyRow();
+            // Internal node (1), navigate to the child of the first
+            // separator >= key, the one a search takes, so that a key
+            // inserted again finds its tombstone; key is larger than all
+            // falls through to the rightmost child
+            int slot = min(node.lowerBound(key), node.count() - 1);
+            if (slot == -1) {
+                unpinNode(currentRow, false);
+                return currentRow;
+            }
 
-            // Write both nodes
-            writeNode(rowNum, node);
-            writeNode(newChildRow, newNode);
+            // Separators hold the max key of their child, so a new max raises
+            // the rightmost separator on the way down
+            bool newMax = key > node.key(slot);
+            if (newMax) {
+                node.set(slot, key, node.address(slot));
+            }
+            int childRow = node.address(slot);
+            unpinNode(currentRow, newMax);
+            latchNode(childRow, true);
+            latched.push_back(childRow);
+
+            // A copy-on-write update works on a copy of every node on the
+            // path; the parent (already a copy) is pointed at it
+            int copyRow = shadowRow(childRow);
+            if (copyRow != childRow) {
+                node = pinNode(currentRow);
+                node.set(slot, node.key(slot), copyRow);
+                unpinNode(currentRow, true);
+                childRow = copyRow;
+            }
 
-            return true; // Split occurred
-        } else {
-            // Node is not full, just insert
-            node.records.push_back(Record(key, address));
-            sort(node.records.begin(), node.records.end(),
-                 [](const Record& a, const Record& b) { return a.key < b.key; });
-            writeNode(rowNum, node);
-            return false;
+            path.push_back({currentRow, slot});
+            currentRow = childRow;
         }
     }
 
-    // Find an empty row from free list (skip row 0 which manages the free list)
-    int findEmptyRow() {
-        Node freeListHead = readNode(0);
-        if (freeListHead.nextEmpty != -1) {
-            int emptyRow = freeListHead.nextEmpty;
-            Node emptyNode = readNode(emptyRow);
-            // Update free list head to point to next empty
-            freeListHead.nextEmpty = emptyNode.nextEmpty;
-            writeNode(0, freeListHead);
-            return emptyRow;
+    // Insert into a node and handle splits. The slot is found by binary
+    // search and the tail moved once; a full node is split at the midpoint
+    // of the m+1 entries, copying the upper half straight into the new row.
+    bool insertIntoNode(int rowNum, const Key& key, Value address, Key& promotedKey, int& newChildRow) {
+        NodeView node = pinNode(rowNum);
+        int pos = node.lowerBound(key);
+
+        // A key deleted lazily (see Index::DeleteARecord) takes its
+        // tombstone back, so a key never has two entries
+        if (pos < node.count() && node.key(pos) == key &&
+            isTombstone(node.address(pos))) {
+            node.set(pos, key, address);
+            unpinNode(rowNum, true);
+            return false;
         }
-        throw runtime_error("No empty rows available");
-    }
-
-    // Find parent of a given row, returns -1 if no parent (is root)
-    int findParent(int targetRow, int currentRow, int& posInParent) {
-        if (currentRow == targetRow) return -1;
 
-        Node node = readNode(currentRow);
+        // A node can hold m records maximum
+        if (node.count() < m) {
+            node.insertAt(pos, key, address);
+            unpinNode(rowNum, true);
+            return false;
+        }
 
-        // Check if any child matches
-        for (int i = 0; i < node.records.size(); i++) {
-            if (node.records[i].address == targetRow) {
-                posInParent = i;
-                return currentRow;
-            }
+        // Node is full: the first medianIdx of the m+1 entries stay here,
+        // the rest go to a new node of the same type. The row is allocated
+        // unpinned, since the file may grow
+        int medianIdx = (m + 1) / 2;
+        INDEX_COUNT(stats(), splits, 1);
+        unpinNode(rowNum, false);
+        newChildRow = takeFreeRow();
+        node = pinNode(rowNum);
+        NodeView newNode = pinNode(newChildRow);
+        newNode.setNodeType(node.nodeType());
+        newNode.setLevel(node.level());
+        newNode.setCount(0);
+        newNode.setNextLeaf(-1);
+
+        if (pos < medianIdx) {
+            // New entry lands in the left half, which gives up one more
+            newNode.append(&node.entries[medianIdx - 1], m - (medianIdx - 1));
+            node.setCount(medianIdx - 1);
+            node.insertAt(pos, key, address);
+        } else {
+            newNode.append(&node.entries[medianIdx], m - medianIdx);
+            node.setCount(medianIdx);
+            newNode.insertAt(pos - medianIdx, key, address);
         }
 
-        // If internal node, search recursively in children
-        if (node.nodeType == 1) {
-            for (int i = 0; i < node.records.size(); i++) {
-                int parent = findParent(targetRow, node.records[i].address, posInParent);
-                if (parent != -1) return parent;
-            }
+        // For parent: use LARGEST key from LEFT child
+        promotedKey = node.key(medianIdx - 1);
+
+        // Link the new leaf in after the one that was split
+        if (node.nodeType() == 0) {
+            newNode.setNextLeaf(node.nextLeaf());
+            node.setNextLeaf(newChildRow);
         }
 
-        return -1;
+        unpinNode(newChildRow, true);
+        unpinNode(rowNum, true);
+        return true; // Split occurred
     }
 
-    int rootRow = -1; // Track the root row
-
 public:
     /*void initialize(char* fname, int numRecords, int order) {
         filename = fname;
@@ -234,70 +243,98 @@ public:
         m = order;
         rootRow = -1;
     }*/
+    // Open an existing index, checking it has this m and at least this
+    // row count
     BTreeAddition(int m, int numberOfRecords,char* filename) {
-        this->m = m;
-        this->numberOfRecords = numberOfRecords;
-        this->filename = filename;
-        rootRow = -1;
+        openIndexFile(filename, numberOfRecords, m);
+    }
+
+    // Open an existing index with the m and row count of its header
+    BTreeAddition(char* filename) {
+        openIndexFile(filename);
     }
 
     // Main addition function
-    void addRecord(int key, int dataAddress) {
-        // Find the first row with nodeType = 1 (internal) or 0 (leaf) as root
-        // Start from row 1 (row 0 is for free list management)
-        if (rootRow == -1) {
-            for (int i = 1; i < numberOfRecords; i++) {
-                Node node = readNode(i);
-                if (node.nodeType == 1 || node.nodeType == 0) {
-                    rootRow = i;
-                    break;
-                }
-            }
-        }
+    void addRecord(const Key& key, Value dataAddress) {
+        INDEX_TIMED(stats(), addRecord);
+        INDEX_COUNT(stats(), inserts, 1);
+        // Other writers wait here only in the modes that need it
+        unique_lock<mutex> turn = writerTurn();
+        insertRecord(key, dataAddress);
+        // Write the rows modified in the buffer pool back to the file (with
+        // deferred writes, once enough have gathered)
+        flushOperation();
+    }
 
-        if (rootRow == -1) {
-            // No root exists, create first leaf node at row 1
-            rootRow = findEmptyRow(); // This will get row 1 from free list
+    void insertRecord(const Key& key, Value dataAddress) {
+        // -1 marks a deleted entry once lazy deletes are used on the file
+        if (dataAddress == static_cast<Value>(-1) &&
+            (lazyDeletes || hasTombstones())) {
+            throw runtime_error("Address -1 marks a deleted entry");
+        }
+        beginUpdate();
+
+        // The root row is kept in record 0; it is still free in a new file.
+        // Every latch taken on the way is released at the end
+        vector<int> latched;
+        int rootRow = latchRoot(true);
+        latched.push_back(rootRow);
+        NodeView rootView = pinNode(rootRow);
+        bool empty = rootView.nodeType() == -1;
+        unpinNode(rootRow, false);
+        if (empty) {
+            // No root exists, create first leaf node (row 1 in a new file)
+            rootRow = takeFreeRow();
             Node root;
             root.nodeType = 0; // Leaf
+            root.level = 0;
             root.nextEmpty = -1;
             root.records.push_back(Record(key, dataAddress));
             writeNode(rootRow, root);
+            setRootRow(rootRow);
+            changeTreeSize(1, 1);
+            unlatchNodes(latched, true);
             return;
         }
+        rootRow = shadowRow(rootRow);
+        setRootRow(rootRow);
 
         // Find correct leaf position
-        int leafRow = findInsertPosition(key, rootRow);
+        vector<PathEntry> path;
+        int leafRow = findInsertPosition(key, rootRow, path, latched);
 
         // Insert into leaf
-        int promotedKey, newChildRow;
+        Key promotedKey;
+        int newChildRow;
         bool split = insertIntoNode(leafRow, key, dataAddress, promotedKey, newChildRow);
+        changeTreeSize(1, 0);
 
         if (split) {
             // Handle split - need to promote to parent
-            handleSplit(leafRow, promotedKey, newChildRow);
+            handleSplit(path, leafRow, promotedKey, newChildRow);
         }
+        unlatchNodes(latched, true);
     }
 
-    void handleSplit(int leftChildRow, int promotedKey, int rightChildRow) {
-        // Find parent of the child that was split
-        int posInParent;
-        int parentRow = findParent(leftChildRow, rootRow, posInParent);
-
-        if (parentRow == -1) {
+private:
+    // Promote a split into the parent recorded on the descent path
+    void handleSplit(vector<PathEntry>& path, int leftChildRow, const Key& promotedKey, int rightChildRow) {
+        if (path.empty()) {
             // No parent exists, create new root
             // Internal nodes should be at lower row numbers than leaves
 
             // Get largest key from right child
             Node rightChild = readNode(rightChildRow);
-            int rightLargestKey = rightChild.records.empty() ? 999999 : rightChild.records.back().key;
+            Key rightLargestKey = rightChild.records.back().key;
 
             Node newRoot;
             newRoot.nodeType = 1; // Internal
+            newRoot.level = rightChild.level + 1;
             newRoot.nextEmpty = -1;
 
             // Get row for new root
-            int newRootRow = findEmptyRow();
+            int newRootRow = takeFreeRow();
+            changeTreeSize(0, 1);
 
             // If the new root row is higher than the left child row, swap them
             // We want internal nodes at lower rows, leaves at higher rows
@@ -314,39 +351,37 @@ public:
 
                 // Write root to the lower row (leftChildRow)
                 writeNode(leftChildRow, newRoot);
-                rootRow = leftChildRow; // Update root tracker
+                setRootRow(leftChildRow);
             } else {
                 // Normal case - root is already at lower row
                 newRoot.records.push_back(Record(promotedKey, leftChildRow)); // Left child
                 newRoot.records.push_back(Record(rightLargestKey, rightChildRow)); // Right child
 
                 writeNode(newRootRow, newRoot);
-                rootRow = newRootRow; // Update root
+                setRootRow(newRootRow);
             }
         } else {
             // Parent exists, insert promoted key and new child pointer
-            Node parent = readNode(parentRow);
+            int parentRow = path.back().row;
+            int posInParent = path.back().slot;
+            path.pop_back();
 
             // Get the largest key in the right child
-            Node rightChild = readNode(rightChildRow);
-            int rightLargestKey = rightChild.records.empty() ? 999999 : rightChild.records.back().key;
+            NodeView rightChild = pinNode(rightChildRow);
+            Key rightLargestKey = rightChild.key(rightChild.count() - 1);
+            unpinNode(rightChildRow, false);
 
             // Update the existing entry for leftChildRow to have the new promoted key
-            parent.records[posInParent].key = promotedKey;
-
-            // Insert the new entry for rightChildRow after it
-            parent.records.insert(parent.records.begin() + posInParent + 1,
-                                 Record(rightLargestKey, rightChildRow));
-
-            // Check if parent needs to split
-            if (parent.records.size() >= m) {
-                int parentPromotedKey, newParentRow;
-                // Recursively split parent
-                writeNode(parentRow, parent);
-                insertIntoNode(parentRow, rightLargestKey, rightChildRow, parentPromotedKey, newParentRow);
-                handleSplit(parentRow, parentPromotedKey, newParentRow);
-            } else {
-                writeNode(parentRow, parent);
+            NodeView parent = pinNode(parentRow);
+            parent.set(posInParent, promotedKey, parent.address(posInParent));
+            unpinNode(parentRow, true);
+
+            // Insert the new entry for rightChildRow after it, splitting the
+            // parent if it is full
+            Key parentPromotedKey;
+            int newParentRow;
+            if (insertIntoNode(parentRow, rightLargestKey, rightChildRow, parentPromotedKey, newParentRow)) {
+                handleSplit(path, parentRow, parentPromotedKey, newParentRow);
             }
         }
     }
@@ -0,0 +1,61 @@
+// Insert micro-benchmark: per-insert cost of BTreeAddition::addRecord
+// across node orders. User CPU time is reported apart from wall time so
+// the in-node work is not hidden behind the write-back at each flush.
+// With deferred set, rows are written back in batches (deferWrites) and
+// the final flush is timed too.
+//
+// Usage: bench_insert [inserts per order] [seed] [deferred]
+#include "addition.cpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <sys/resource.h>
+
+static double userSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    int inserts = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+    bool deferred = argc > 3 && atoi(argv[3]);
+    const char* filename = "bench_insert.bin";
+    const int orders[] = {4, 8, 16, 32, 64, 128, 256, 512};
+
+    // Distinct keys in random order
+    vector<int> keys(inserts);
+    for (int i = 0; i < inserts; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys.begin(), keys.end(), mt19937(seed));
+
+    printf("%6s %10s %14s %14s\n", "m", "inserts", "user ns/op", "wall ns/op");
+    for (int m : orders) {
+        // Nodes are at least half full, plus room for the splits on the way
+        int numberOfRecords = 2 * inserts / (m / 2) + 64;
+
+        IndexFileHandler handler;
+        if (deferred) {
+            handler.deferWrites = true;
+            handler.bufferPoolFrames = 2 * handler.deferredRows;
+        }
+        handler.createIndexFile(const_cast<char*>(filename), numberOfRecords, m);
+        BTreeAddition btree(m, numberOfRecords, const_cast<char*>(filename));
+
+        double userStart = userSeconds();
+        auto wallStart = chrono::steady_clock::now();
+        for (int i = 0; i < inserts; i++) {
+            btree.addRecord(keys[i], i);
+        }
+        btree.flush();
+        double wall = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+        double user = userSeconds() - userStart;
+
+        printf("%6d %10d %14.1f %14.1f\n", m, inserts, user * 1e9 / inserts, wall * 1e9 / inserts);
+    }
+
+    remove(filename);
+    return 0;
+}
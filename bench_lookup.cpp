@@ -0,0 +1,149 @@
+// Concurrent lookup benchmark and stress check. Threads look up random keys
+// while a share of their operations insert and delete, first on a
+// memory-mapped index (optimistic lookups) and then on a buffered one
+// (latched lookups), with 1, 2, 4, ... threads.
+// Every result is checked against a reference std::map: even keys are
+// loaded up front and never change, and odd keys belong to one thread each,
+// which keeps its own map of them. A key another thread owns may or may
+// not be there, but its address is always derived from the key. At the
+// end the whole index is compared with the merged maps. Exits with 1 if
+// anything did not match.
+//
+// Usage: bench_lookup [max threads] [ops per thread] [write percent] [keys] [m]
+#include "addition.cpp"
+#include "Index.cpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <thread>
+
+static int addressOf(int key) {
+    return key / 2 + 1;
+}
+
+struct Run {
+    double seconds;
+    long lookups;
+    long writes;
+    long errors;
+};
+
+static Run runThreads(char* filename, bool memoryMapped, int threads, int ops,
+                      int writePercent, int keys, vector<map<int, int>>& owned) {
+    atomic<long> lookups(0), writes(0), errors(0);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            // Each thread has its own handlers on the shared file
+            IndexFileHandler handler;
+            handler.useMemoryMap = memoryMapped;
+            handler.openIndexFile(filename);
+            BTreeAddition btree(handler.m, 0, filename);
+            Index index(&handler);
+            map<int, int>& mine = owned[t];
+            mt19937 rng(t + 1);
+            long done = 0, changed = 0, wrong = 0;
+
+            for (int i = 0; i < ops; i++) {
+                int key = rng() % (2 * keys);
+                if ((int)(rng() % 100) < writePercent) {
+                    // An odd key of this thread's own
+                    key = (key / 2 / threads * threads + t) * 2 + 1;
+                    if (mine.count(key)) {
+                        index.DeleteARecord(filename, key);
+                        mine.erase(key);
+                    } else {
+                        btree.addRecord(key, addressOf(key));
+                        mine[key] = addressOf(key);
+                    }
+                    changed++;
+                    continue;
+                }
+
+                int address = index.SearchARecord(filename, key);
+                bool ok;
+                if (key % 2 == 0) {
+                    ok = address == addressOf(key);
+                } else if ((key / 2) % threads == t) {
+                    ok = address == (mine.count(key) ? addressOf(key) : -1);
+                } else {
+                    ok = address == -1 || address == addressOf(key);
+                }
+                wrong += !ok;
+                done++;
+            }
+            lookups += done;
+            writes += changed;
+            errors += wrong;
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return Run{seconds, lookups.load(), writes.load(), errors.load()};
+}
+
+// Compare the whole index with the reference
+static long checkIndex(char* filename, int keys, const vector<map<int, int>>& owned) {
+    map<int, int> reference;
+    for (int key = 0; key < 2 * keys; key += 2) {
+        reference[key] = addressOf(key);
+    }
+    for (const map<int, int>& mine : owned) {
+        reference.insert(mine.begin(), mine.end());
+    }
+
+    IndexFileHandler handler;
+    handler.openIndexFile(filename);
+    Index index(&handler);
+    vector<pair<int, int>> entries = index.SearchRange(filename, INT_MIN, INT_MAX);
+    long errors = entries.size() != reference.size();
+    auto expected = reference.begin();
+    for (size_t i = 0; i < entries.size() && expected != reference.end(); i++, ++expected) {
+        errors += entries[i].first != expected->first || entries[i].second != expected->second;
+    }
+    for (const pair<const int, int>& entry : reference) {
+        errors += index.SearchARecord(filename, entry.first) != entry.second;
+    }
+    return errors;
+}
+
+int main(int argc, char* argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : (int)max(1u, thread::hardware_concurrency());
+    int ops = argc > 2 ? atoi(argv[2]) : 200000;
+    int writePercent = argc > 3 ? atoi(argv[3]) : 5;
+    int keys = argc > 4 ? atoi(argv[4]) : 100000;
+    int m = argc > 5 ? atoi(argv[5]) : 64;
+    char filename[] = "bench_lookup.bin";
+    long totalErrors = 0;
+
+    printf("%8s %8s %14s %12s %8s\n", "mode", "threads", "lookups/s", "writes/s", "errors");
+    for (int mapped = 1; mapped >= 0; mapped--) {
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            // The even keys, loaded in order
+            {
+                IndexFileHandler handler;
+                handler.createIndexFile(filename, 16, m);
+                BTreeAddition btree(m, 16, filename);
+                for (int key = 0; key < 2 * keys; key += 2) {
+                    btree.insertRecord(key, addressOf(key));
+                }
+                btree.flush();
+            }
+
+            vector<map<int, int>> owned(threads);
+            Run run = runThreads(filename, mapped, threads, ops, writePercent, keys, owned);
+            long errors = run.errors + checkIndex(filename, keys, owned);
+            totalErrors += errors;
+            printf("%8s %8d %14.0f %12.0f %8ld\n", mapped ? "mmap" : "buffered", threads,
+                   run.lookups / run.seconds, run.writes / run.seconds, errors);
+        }
+    }
+
+    remove(filename);
+    return totalErrors == 0 ? 0 : 1;
+}
@@ -0,0 +1,342 @@
+// Benchmark suite: fixed-seed workloads over a sweep of node orders (m)
+// and key counts (N). Each workload, m and N gives one result with the
+// throughput and the p50/p99/p99.9 latency of a single operation, written
+// to stdout as CSV (the default) or JSON so that two versions can be
+// compared run against run.
+//
+// Workloads, in the order they run on one index of keys 0, 2, 4, ...:
+//   seq_insert   N keys in ascending order, into an index of their own
+//   rand_insert  N keys in random order
+//   lookup_hit   N lookups of keys in the index
+//   lookup_miss  N lookups of the odd keys between them
+//   lookup_zipf  N lookups with zipfian popularity (s = 0.99)
+//   scan         one IndexCursor pass over every key, in order
+//   lookup_async N lookups of keys in the index through AsyncLookups, 64 in
+//                flight; latency is from submit to result
+//   rand_delete  half the keys in random order
+//   mixed        N operations: 80% lookups, 10% inserts, 10% deletes
+//   range_delete every key left, by DeleteRange calls over 1% of the key
+//                space each; latency is per call
+// Every lookup and scanned entry is checked; the suite exits with 1 if one
+// was wrong.
+//
+// Usage: bench_suite [csv|json] [max N] [seed]
+#include "addition.cpp"
+#include "Index.cpp"
+#include "AsyncLookups.cpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+
+struct Result {
+    string workload;
+    int m;
+    int n;
+    long ops;
+    double seconds;
+    double p50, p99, p999; // nanoseconds
+};
+
+// Times one operation at a time and turns the samples into a Result
+class Timer {
+    vector<double> samples;
+    chrono::steady_clock::time_point start, opStart;
+
+    double percentile(double q) const {
+        return samples[min(samples.size() - 1, (size_t)(q * samples.size()))];
+    }
+
+public:
+    explicit Timer(long ops) {
+        samples.reserve(ops);
+        start = chrono::steady_clock::now();
+    }
+
+    void begin() {
+        opStart = chrono::steady_clock::now();
+    }
+
+    void end() {
+        samples.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - opStart).count());
+    }
+
+    // An operation that started at start and overlapped others
+    void add(chrono::steady_clock::time_point start) {
+        samples.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+    }
+
+    Result result(const string& workload, int m, int n) {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        sort(samples.begin(), samples.end());
+        if (samples.empty()) {
+            samples.push_back(0);
+        }
+        return Result{workload, m, n, (long)samples.size(), seconds,
+                      percentile(0.5), percentile(0.99), percentile(0.999)};
+    }
+};
+
+// Ranks 0..n-1, rank r drawn with probability proportional to 1/(r+1)^s
+class Zipf {
+    vector<double> cdf;
+    uniform_real_distribution<double> uniform;
+
+public:
+    Zipf(int n, double s) : cdf(n), uniform(0.0, 1.0) {
+        double sum = 0;
+        for (int r = 0; r < n; r++) {
+            sum += 1.0 / pow(r + 1, s);
+            cdf[r] = sum;
+        }
+        for (double& c : cdf) {
+            c /= sum;
+        }
+    }
+
+    int operator()(mt19937& rng) {
+        int rank = lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+        return min(rank, (int)cdf.size() - 1);
+    }
+};
+
+static int addressOf(int key) {
+    return key + 1;
+}
+
+// Every workload for one m and N, on a fresh index file
+static void runWorkloads(char* filename, int m, int n, unsigned seed,
+                         vector<Result>& results, long& wrong) {
+    mt19937 rng(seed);
+    // Nodes are at least half full, plus room for the splits on the way
+    int numberOfRecords = 2 * n / (m / 2) + 64;
+
+    {
+        IndexFileHandler handler;
+        handler.createIndexFile(filename, numberOfRecords, m);
+        BTreeAddition btree(m, numberOfRecords, filename);
+        Timer timer(n);
+        for (int i = 0; i < n; i++) {
+            timer.begin();
+            btree.addRecord(2 * i, addressOf(2 * i));
+            timer.end();
+        }
+        results.push_back(timer.result("seq_insert", m, n));
+    }
+
+    IndexFileHandler handler;
+    handler.createIndexFile(filename, numberOfRecords, m);
+    BTreeAddition btree(m, numberOfRecords, filename);
+    Index index(&handler);
+
+    vector<int> keys(n);
+    for (int i = 0; i < n; i++) {
+        keys[i] = 2 * i;
+    }
+    shuffle(keys.begin(), keys.end(), rng);
+    {
+        Timer timer(n);
+        for (int key : keys) {
+            timer.begin();
+            btree.addRecord(key, addressOf(key));
+            timer.end();
+        }
+        results.push_back(timer.result("rand_insert", m, n));
+    }
+
+    {
+        Timer timer(n);
+        for (int i = 0; i < n; i++) {
+            int key = keys[rng() % n];
+            timer.begin();
+            int address = index.SearchARecord(filename, key);
+            timer.end();
+            wrong += address != addressOf(key);
+        }
+        results.push_back(timer.result("lookup_hit", m, n));
+    }
+
+    {
+        Timer timer(n);
+        for (int i = 0; i < n; i++) {
+            int key = 2 * (int)(rng() % n) + 1;
+            timer.begin();
+            int address = index.SearchARecord(filename, key);
+            timer.end();
+            wrong += address != -1;
+        }
+        results.push_back(timer.result("lookup_miss", m, n));
+    }
+
+    {
+        // Popular keys are spread over the tree, not packed in one leaf
+        Zipf zipf(n, 0.99);
+        Timer timer(n);
+        for (int i = 0; i < n; i++) {
+            int key = keys[zipf(rng)];
+            timer.begin();
+            int address = index.SearchARecord(filename, key);
+            timer.end();
+            wrong += address != addressOf(key);
+        }
+        results.push_back(timer.result("lookup_zipf", m, n));
+    }
+
+    {
+        IndexCursor<> cursor(&handler);
+        Timer timer(n);
+        int key, address, expected = 0;
+        cursor.seek(0);
+        while (true) {
+            timer.begin();
+            if (!cursor.next(key, address)) {
+                break;
+            }
+            timer.end();
+            wrong += key != expected || address != addressOf(key);
+            expected += 2;
+        }
+        wrong += expected != 2 * n;
+        results.push_back(timer.result("scan", m, n));
+    }
+
+    {
+        // A callback per lookup: its start time is in the capture
+        Timer timer(n);
+        AsyncLookups<> lookups(&handler, 64);
+        vector<AsyncLookups<>::Result> done;
+        for (int i = 0; i < n; i++) {
+            int key = keys[rng() % n];
+            auto start = chrono::steady_clock::now();
+            auto check = [&timer, &wrong, start](const int& key, int address) {
+                timer.add(start);
+                wrong += address != addressOf(key);
+            };
+            while (!lookups.submit(key, check)) {
+                lookups.poll(done, true);
+            }
+        }
+        lookups.drain();
+        results.push_back(timer.result("lookup_async", m, n));
+    }
+
+    {
+        shuffle(keys.begin(), keys.end(), rng);
+        Timer timer(n / 2);
+        for (int i = 0; i < n / 2; i++) {
+            timer.begin();
+            index.DeleteARecord(filename, keys.back());
+            timer.end();
+            keys.pop_back();
+        }
+        results.push_back(timer.result("rand_delete", m, n));
+    }
+
+    {
+        // Inserts use odd keys, which are not in the index yet
+        int nextOdd = 1;
+        Timer timer(n);
+        for (int i = 0; i < n; i++) {
+            int choice = rng() % 10;
+            if (choice == 0 || keys.empty()) {
+                int key = nextOdd;
+                nextOdd += 2;
+                timer.begin();
+                btree.addRecord(key, addressOf(key));
+                timer.end();
+                keys.push_back(key);
+            } else if (choice == 1) {
+                size_t slot = rng() % keys.size();
+                int key = keys[slot];
+                keys[slot] = keys.back();
+                keys.pop_back();
+                timer.begin();
+                index.DeleteARecord(filename, key);
+                timer.end();
+            } else {
+                int key = keys[rng() % keys.size()];
+                timer.begin();
+                int address = index.SearchARecord(filename, key);
+                timer.end();
+                wrong += address != addressOf(key);
+            }
+        }
+        results.push_back(timer.result("mixed", m, n));
+    }
+
+    {
+        // The even keys and the odd ones of mixed are all below 2N
+        int span = max(2 * n / 100, 1);
+        long expected = handler.getKeyCount(), deleted = 0;
+        Timer timer(100);
+        for (int low = 0; low < 2 * n; low += span) {
+            timer.begin();
+            deleted += index.DeleteRange(filename, low, low + span - 1);
+            timer.end();
+        }
+        wrong += deleted != expected || handler.getKeyCount() != 0;
+        results.push_back(timer.result("range_delete", m, n));
+    }
+}
+
+static void printCsv(const vector<Result>& results) {
+    printf("workload,m,n,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+    for (const Result& r : results) {
+        printf("%s,%d,%d,%ld,%.6f,%.1f,%.1f,%.1f,%.1f\n", r.workload.c_str(), r.m, r.n, r.ops,
+               r.seconds, r.ops / r.seconds, r.p50, r.p99, r.p999);
+    }
+}
+
+static void printJson(const vector<Result>& results) {
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        printf("  {\"workload\": \"%s\", \"m\": %d, \"n\": %d, \"ops\": %ld, \"seconds\": %.6f, "
+               "\"ops_per_sec\": %.1f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f}%s\n",
+               r.workload.c_str(), r.m, r.n, r.ops, r.seconds, r.ops / r.seconds, r.p50, r.p99,
+               r.p999, i + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+}
+
+int main(int argc, char* argv[]) {
+    string format = argc > 1 ? argv[1] : "csv";
+    int maxN = argc > 2 ? atoi(argv[2]) : 100000;
+    unsigned seed = argc > 3 ? atoi(argv[3]) : 1;
+    char filename[] = "bench_suite.bin";
+    const int orders[] = {8, 32, 128};
+    if (format != "csv" && format != "json") {
+        fprintf(stderr, "Usage: bench_suite [csv|json] [max N] [seed]\n");
+        return 2;
+    }
+
+    // N = 10000, 100000, ... up to maxN (just maxN if it is smaller)
+    vector<int> sizes;
+    for (long n = 10000; n <= maxN; n *= 10) {
+        sizes.push_back(n);
+    }
+    if (sizes.empty()) {
+        sizes.push_back(max(maxN, 1));
+    }
+
+    vector<Result> results;
+    long wrong = 0;
+    for (int m : orders) {
+        for (int n : sizes) {
+            runWorkloads(filename, m, n, seed, results, wrong);
+        }
+    }
+    remove(filename);
+
+    if (format == "json") {
+        printJson(results);
+    } else {
+        printCsv(results);
+    }
+    if (wrong > 0) {
+        fprintf(stderr, "%ld lookups or scanned entries were wrong\n", wrong);
+        return 1;
+    }
+    return 0;
+}
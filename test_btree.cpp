@@ -1,7 +1,809 @@
-// Interactive B-tree menu system
+// Interactive B-tree menu system. With --check it instead runs fixed-seed
+// checks against a std::map and exits with 1 if one fails.
 #include "addition.cpp"
+#include "AsyncLookups.cpp"
+#include "BulkLoader.cpp"
 #include "Index.cpp"
+#include "LegacyIndexFile.cpp"
+#include <algorithm>
+#include <climits>
+#include <fstream>
 #include <limits>
+#include <map>
+#include <random>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+static void expect(bool ok, const string& what) {
+    if (!ok) {
+        failures++;
+        cerr << "FAIL: " << what << endl;
+    }
+}
+
+// Shape of the tree below row: every leaf at the same depth, no empty node
+// below the root, no internal node there with a single child and none
+// under the minimum of Index::getMinKeys (m/2, and at least two in an
+// internal node). Leaf entries include tombstones
+struct Shape {
+    int leafDepth = -1;
+    bool sameDepth = true;
+    int emptyNodes = 0;
+    int oneChildNodes = 0;
+    int underfullNodes = 0;
+    long long leafEntries = 0;
+};
+
+static void walk(IndexFileHandler<>& handler, int row, int depth, bool root, Shape& shape) {
+    NodeView<> node = handler.pinNode(row);
+    int type = node.nodeType();
+    vector<int> children;
+    for (int i = 0; type == 1 && i < node.count(); i++) {
+        children.push_back(node.address(i));
+    }
+    if (!root && node.count() == 0) {
+        shape.emptyNodes++;
+    }
+    if (!root && type == 1 && node.count() == 1) {
+        shape.oneChildNodes++;
+    }
+    if (!root && node.count() < (type == 1 ? max(handler.m / 2, 2) : handler.m / 2)) {
+        shape.underfullNodes++;
+    }
+    int count = node.count();
+    handler.unpinNode(row, false);
+
+    if (type == 0) {
+        shape.leafEntries += count;
+        if (shape.leafDepth == -1) {
+            shape.leafDepth = depth;
+        }
+        shape.sameDepth = shape.sameDepth && shape.leafDepth == depth;
+    }
+    for (int child : children) {
+        walk(handler, child, depth + 1, false, shape);
+    }
+}
+
+// The index holds exactly the reference's keys and addresses, in a
+// balanced tree whose header matches it
+static Shape verify(IndexFileHandler<>& handler, Index<>& index, char* filename,
+                    const map<int, int>& reference, const string& what) {
+    vector<pair<int, int>> all = index.SearchRange(filename, INT_MIN, INT_MAX);
+    expect(all == vector<pair<int, int>>(reference.begin(), reference.end()),
+           what + ": range scan differs from the reference");
+    expect(handler.getKeyCount() == (long long)reference.size(), what + ": key count");
+
+    Shape shape;
+    walk(handler, handler.getRootRow(), 1, true, shape);
+    expect(shape.sameDepth, what + ": leaves at different depths");
+    expect(shape.emptyNodes == 0, what + ": empty nodes below the root");
+    expect(shape.oneChildNodes == 0, what + ": internal nodes with one child");
+    expect(shape.underfullNodes == 0, what + ": nodes under the minimum");
+    expect(handler.getHeight() == shape.leafDepth, what + ": height");
+    return shape;
+}
+
+// Remove an index file and the log next to it
+static void removeIndexFile(char* filename) {
+    remove(filename);
+    remove(WriteAheadLog::fileFor(filename).c_str());
+}
+
+// Deletes outnumber inserts at the smallest order, down to an empty index
+static void checkDeletesAtOrder3() {
+    char filename[] = "test_check.bin";
+    IndexFileHandler handler;
+    handler.createIndexFile(filename, 16, 3);
+    BTreeAddition btree(filename);
+    Index index(&handler);
+    map<int, int> reference;
+    mt19937 rng(3);
+
+    for (int i = 0; i < 2000; i++) {
+        int key = rng() % 4000;
+        if (!reference.count(key)) {
+            btree.addRecord(key, i);
+            reference[key] = i;
+        }
+    }
+    for (int op = 0; op < 6000; op++) {
+        int key = rng() % 4000;
+        if (rng() % 4 == 0) {
+            if (!reference.count(key)) {
+                btree.addRecord(key, op);
+                reference[key] = op;
+            }
+        } else if (reference.count(key)) {
+            index.DeleteARecord(filename, key);
+            reference.erase(key);
+        }
+        if (op % 500 == 499) {
+            verify(handler, index, filename, reference, "m=3 deletes");
+        }
+    }
+    while (!reference.empty()) {
+        index.DeleteARecord(filename, reference.begin()->first);
+        reference.erase(reference.begin());
+    }
+    verify(handler, index, filename, reference, "m=3 delete all");
+    remove(filename);
+}
+
+// Bulk loads of every size up to a few nodes and some larger ones, at
+// orders and fill factors whose right edge needs merging or evening out;
+// then the tree must stay in shape under inserts and deletes
+static void checkBulkLoad() {
+    char filename[] = "test_check.bin";
+    vector<int> sizes;
+    for (int n = 1; n <= 80; n++) {
+        sizes.push_back(n);
+    }
+    for (int n = 81; n <= 2000; n = n * 5 / 4) {
+        sizes.push_back(n);
+    }
+    for (int m : {3, 4, 7, 8, 9, 16, 33}) {
+        for (double fillFactor : {0.5, 0.6, 0.75, 0.9, 1.0}) {
+            for (int n : sizes) {
+                string what = "bulk load m=" + to_string(m) + " fill " +
+                              to_string(fillFactor) + " n=" + to_string(n);
+                {
+                    IndexFileHandler handler;
+                    handler.createIndexFile(filename, 16, m);
+                }
+                map<int, int> reference;
+                {
+                    BulkLoader loader(m, 16, filename, fillFactor);
+                    for (int i = 0; i < n; i++) {
+                        loader.add(i * 2, i);
+                        reference[i * 2] = i;
+                    }
+                    loader.finish();
+                }
+                IndexFileHandler handler;
+                handler.openIndexFile(filename);
+                Index index(&handler);
+                verify(handler, index, filename, reference, what);
+
+                if (n % 16 == 5) {
+                    BTreeAddition btree(filename);
+                    mt19937 rng(n);
+                    for (int op = 0; op < 2 * n; op++) {
+                        int key = rng() % (4 * n);
+                        if (reference.count(key)) {
+                            index.DeleteARecord(filename, key);
+                            reference.erase(key);
+                        } else {
+                            btree.addRecord(key, op);
+                            reference[key] = op;
+                        }
+                    }
+                    verify(handler, index, filename, reference, what + " updated");
+                }
+            }
+        }
+    }
+    removeIndexFile(filename);
+}
+
+// File modes the bulk deletes are checked in; the last is the default
+// mode with lazy deletes
+static const char* modeNames[] = {"in place", "mmap", "WAL", "shadow", "lazy"};
+
+// DeleteRange and DeleteMany mixed with inserts and single deletes, in
+// every file mode and at the smallest order and a larger one
+static void checkBulkDeletes() {
+    char filename[] = "test_check.bin";
+    for (int mode = 0; mode < 5; mode++) {
+        for (int m : {3, 8}) {
+            string what = string(modeNames[mode]) + " m=" + to_string(m);
+            IndexFileHandler handler;
+            handler.useMemoryMap = mode == 1;
+            handler.useWriteAheadLog = mode == 2;
+            handler.useShadowPaging = mode == 3;
+            handler.lazyDeletes = mode == 4;
+            handler.createIndexFile(filename, 16, m);
+            BTreeAddition btree(filename);
+            Index index(&handler);
+            map<int, int> reference;
+            mt19937 rng(19 + mode);
+
+            for (int i = 0; i < 3000; i++) {
+                int key = rng() % 6000;
+                if (!reference.count(key)) {
+                    btree.addRecord(key, i);
+                    reference[key] = i;
+                }
+            }
+            for (int op = 0; op < 400; op++) {
+                int key = rng() % 6000;
+                int choice = rng() % 10;
+                if (choice < 4) {
+                    for (int i = 0; i < 20; i++) {
+                        int added = (key + i * 7) % 6000;
+                        if (!reference.count(added)) {
+                            btree.addRecord(added, op);
+                            reference[added] = op;
+                        }
+                    }
+                } else if (choice < 6) {
+                    auto found = reference.lower_bound(key);
+                    if (found != reference.end()) {
+                        index.DeleteARecord(filename, found->first);
+                        reference.erase(found);
+                    }
+                } else if (choice < 8) {
+                    int high = key + (op % 20 == 0 ? 2000 : (int)(rng() % 200));
+                    long long expected = 0;
+                    for (auto it = reference.lower_bound(key);
+                         it != reference.end() && it->first <= high;) {
+                        it = reference.erase(it);
+                        expected++;
+                    }
+                    expect(index.DeleteRange(filename, key, high) == expected,
+                           what + ": DeleteRange count");
+                } else {
+                    // Unsorted, with repeats and keys not in the index
+                    vector<int> keys;
+                    for (int i = 0; i < 60; i++) {
+                        keys.push_back(i % 3 == 0 ? rng() % 6000 : key + rng() % 300);
+                    }
+                    shuffle(keys.begin(), keys.end(), rng);
+                    long long expected = 0;
+                    for (int deleted : keys) {
+                        expected += reference.erase(deleted);
+                    }
+                    expect(index.DeleteMany(filename, keys) == expected,
+                           what + ": DeleteMany count");
+                }
+                if (op % 50 == 49) {
+                    verify(handler, index, filename, reference, what);
+                }
+            }
+            expect(index.DeleteRange(filename, INT_MIN, INT_MAX) ==
+                       (long long)reference.size(),
+                   what + ": DeleteRange of everything");
+            reference.clear();
+            verify(handler, index, filename, reference, what + " emptied");
+        }
+    }
+    removeIndexFile(filename);
+}
+
+// Random inserts and deletes on an index holding present's keys, made
+// before a fork so that the parent knows the child's
+static vector<pair<int, bool>> makeOperations(map<int, int> present, unsigned seed,
+                                              int count) {
+    vector<pair<int, bool>> operations;
+    mt19937 rng(seed);
+    for (int i = 0; i < count; i++) {
+        int key = rng() % 3000;
+        bool insert = !present.count(key);
+        if (insert) {
+            present[key] = i;
+        } else {
+            present.erase(key);
+        }
+        operations.push_back(make_pair(key, insert));
+    }
+    return operations;
+}
+
+// The address of an insert is its position in operations
+static void applyOperations(BTreeAddition<>& btree, Index<>& index, char* filename,
+                            const vector<pair<int, bool>>& operations) {
+    for (size_t i = 0; i < operations.size(); i++) {
+        if (operations[i].second) {
+            btree.addRecord(operations[i].first, i);
+        } else {
+            index.DeleteARecord(filename, operations[i].first);
+        }
+    }
+}
+
+static void applyOperations(map<int, int>& reference,
+                            const vector<pair<int, bool>>& operations) {
+    for (size_t i = 0; i < operations.size(); i++) {
+        if (operations[i].second) {
+            reference[operations[i].first] = i;
+        } else {
+            reference.erase(operations[i].first);
+        }
+    }
+}
+
+// Operations made in a child that then exits, after which the index file
+// loses every write since it was last synced (it is put back as it was
+// created, with rows enough that it never grew): only the log has them,
+// and opening the file replays it
+static void checkLogReplay() {
+    char filename[] = "test_check.bin";
+    const int rows = 4096;
+    {
+        IndexFileHandler handler;
+        handler.useWriteAheadLog = true;
+        handler.createIndexFile(filename, rows, 4);
+    }
+    string created;
+    {
+        ifstream file(filename, ios::binary);
+        created.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    }
+    map<int, int> reference;
+    vector<pair<int, bool>> operations = makeOperations(reference, 7, 4000);
+    pid_t child = fork();
+    if (child == 0) {
+        IndexFileHandler handler;
+        handler.useWriteAheadLog = true;
+        handler.bufferPoolFrames = 1024;
+        handler.openIndexFile(filename);
+        BTreeAddition btree(filename);
+        Index index(&handler);
+        applyOperations(btree, index, filename, operations);
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    expect(WIFEXITED(status) && WEXITSTATUS(status) == 0, "WAL child failed");
+    {
+        ofstream file(filename, ios::binary | ios::in);
+        file.write(created.data(), created.size());
+    }
+
+    applyOperations(reference, operations);
+    IndexFileHandler handler;
+    handler.useWriteAheadLog = true;
+    handler.openIndexFile(filename);
+    expect(handler.getRowCount() == rows, "WAL: the file grew around the log");
+    Index index(&handler);
+    verify(handler, index, filename, reference, "WAL replay");
+    removeIndexFile(filename);
+}
+
+// A shadow-paged file reopened from the root in its header, after both a
+// clean close and a child exiting between operations
+static void checkShadowReopen() {
+    char filename[] = "test_check.bin";
+    {
+        IndexFileHandler handler;
+        handler.useShadowPaging = true;
+        handler.createIndexFile(filename, 16, 4);
+    }
+    map<int, int> reference;
+    bool rootMoved = false;
+    for (int round = 0; round < 6; round++) {
+        vector<pair<int, bool>> operations = makeOperations(reference, round, 800);
+        string what = "shadow round " + to_string(round);
+        bool crash = round % 2 == 1;
+        if (crash) {
+            pid_t child = fork();
+            if (child == 0) {
+                IndexFileHandler handler;
+                handler.openIndexFile(filename);
+                BTreeAddition btree(filename);
+                Index index(&handler);
+                applyOperations(btree, index, filename, operations);
+                _exit(0);
+            }
+            int status;
+            waitpid(child, &status, 0);
+            expect(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                   what + ": child failed");
+        }
+
+        IndexFileHandler handler;
+        handler.openIndexFile(filename);
+        expect(handler.useShadowPaging, what + ": shadow paging flag lost");
+        BTreeAddition btree(filename);
+        Index index(&handler);
+        if (!crash) {
+            applyOperations(btree, index, filename, operations);
+        }
+        applyOperations(reference, operations);
+        verify(handler, index, filename, reference, what);
+        rootMoved = rootMoved || handler.getRootRow() != 1;
+    }
+    expect(rootMoved, "shadow: the root never moved");
+
+    IndexFileHandler handler;
+    handler.openIndexFile(filename);
+    Index index(&handler);
+    verify(handler, index, filename, reference, "shadow final reopen");
+    removeIndexFile(filename);
+}
+
+// Lazy deletes leave tombstones that searches skip; compaction in small
+// steps removes every one and rebalances like an eager delete
+static void checkTombstoneCompaction() {
+    char filename[] = "test_check.bin";
+    IndexFileHandler handler;
+    handler.lazyDeletes = true;
+    handler.createIndexFile(filename, 16, 4);
+    BTreeAddition btree(filename);
+    Index index(&handler);
+    map<int, int> reference;
+    mt19937 rng(24);
+
+    for (int i = 0; i < 3000; i++) {
+        int key = rng() % 6000;
+        if (!reference.count(key)) {
+            btree.addRecord(key, i);
+            reference[key] = i;
+        }
+    }
+    for (int op = 0; op < 4000; op++) {
+        int key = rng() % 6000;
+        if (reference.count(key)) {
+            index.DeleteARecord(filename, key);
+            reference.erase(key);
+        } else if (op % 4 == 0) {
+            // Takes back the key's tombstone, if it has one
+            btree.addRecord(key, op);
+            reference[key] = op;
+        }
+    }
+    Shape before = verify(handler, index, filename, reference, "tombstones");
+    long long tombstones = before.leafEntries - (long long)reference.size();
+    expect(tombstones > 0, "tombstones: lazy deletes left none");
+
+    long long removed = 0;
+    for (int call = 0; call < 10000; call++) {
+        removed += index.CompactTombstones(chrono::milliseconds(1000), 4);
+        if (call % 25 == 24) {
+            Shape shape = verify(handler, index, filename, reference, "compaction");
+            if (shape.leafEntries == (long long)reference.size()) {
+                break;
+            }
+        }
+    }
+    Shape after = verify(handler, index, filename, reference, "compacted");
+    expect(after.leafEntries == (long long)reference.size(),
+           "compacted: tombstones left in the leaves");
+    expect(removed == tombstones, "compacted: tombstones removed miscounted");
+    removeIndexFile(filename);
+}
+
+// A legacy file converts from the leaves its root reaches: the root lists
+// one child twice and a stale leaf row left by a split still holds keys
+static void checkLegacyConversion() {
+    char legacyFilename[] = "test_legacy.bin";
+    char filename[] = "test_check.bin";
+    const int legacyM = 4;
+    vector<vector<int>> rows = {
+        {-1, 6},
+        {1, 10, 2, 20, 3, 20, 3, 30, 4},
+        {0, 2, 3, 6, 7, 10, 11},
+        {0, 14, 15, 18, 19},
+        {0, 22, 23, 26, 27, 30, 31},
+        {0, 10, 99, 14, 98},
+        {-1},
+    };
+    {
+        ofstream legacy(legacyFilename, ios::binary);
+        for (vector<int>& row : rows) {
+            row.resize(2 * legacyM + 1, -1);
+            legacy.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(int));
+        }
+    }
+    map<int, int> reference;
+    for (int key : {2, 6, 10, 14, 18, 22, 26, 30}) {
+        reference[key] = key + 1;
+    }
+    try {
+        convertLegacyIndexFile(legacyFilename, legacyM, filename, 4);
+        IndexFileHandler handler;
+        handler.openIndexFile(filename);
+        Index index(&handler);
+        verify(handler, index, filename, reference, "legacy conversion");
+    } catch (const exception& e) {
+        expect(false, string("legacy conversion: ") + e.what());
+    }
+    remove(legacyFilename);
+    removeIndexFile(filename);
+}
+
+// Batches of keys, present and missing, unsorted and repeated, get from
+// SearchMany what SearchARecord returns for each; cached and mapped
+static void checkSearchMany() {
+    char filename[] = "test_check.bin";
+    for (int m : {3, 4, 16}) {
+        for (bool mapped : {false, true}) {
+            string what = "search many m=" + to_string(m) +
+                          (mapped ? " mmap" : " in place");
+            IndexFileHandler handler;
+            handler.useMemoryMap = mapped;
+            handler.createIndexFile(filename, 16, m);
+            BTreeAddition btree(filename);
+            Index index(&handler);
+            map<int, int> reference;
+            mt19937 rng(m);
+            for (int i = 0; i < 3000; i++) {
+                int key = rng() % 6000;
+                if (!reference.count(key)) {
+                    btree.addRecord(key, i);
+                    reference[key] = i;
+                }
+            }
+
+            for (int batch = 0; batch < 60; batch++) {
+                vector<int> keys(rng() % 400);
+                for (int& key : keys) {
+                    key = (int)(rng() % 6020) - 10;
+                }
+                vector<int> found = index.SearchMany(filename, keys);
+                bool same = found.size() == keys.size();
+                for (size_t i = 0; same && i < keys.size(); i++) {
+                    auto it = reference.find(keys[i]);
+                    int expected = it == reference.end() ? -1 : it->second;
+                    same = found[i] == expected &&
+                           found[i] == index.SearchARecord(filename, keys[i]);
+                }
+                expect(same, what + ": batch " + to_string(batch) +
+                                 " differs from SearchARecord");
+            }
+            removeIndexFile(filename);
+        }
+    }
+}
+
+// AsyncLookups, with a pool too small for the tree so that most nodes
+// are read from the file, return what SearchARecord does for present and
+// missing keys, through tags and through callbacks
+static void checkAsyncLookups() {
+    char filename[] = "test_check.bin";
+    map<int, int> reference;
+    mt19937 rng(22);
+    {
+        IndexFileHandler handler;
+        handler.createIndexFile(filename, 16, 8);
+        BTreeAddition btree(filename);
+        for (int i = 0; i < 4000; i++) {
+            int key = rng() % 8000;
+            if (!reference.count(key)) {
+                btree.addRecord(key, i);
+                reference[key] = i;
+            }
+        }
+        handler.flush();
+    }
+
+    IndexFileHandler handler;
+    handler.bufferPoolFrames = 4;
+    handler.openIndexFile(filename);
+    Index index(&handler);
+    for (int queueDepth : {1, 3, 16, 64}) {
+        string what = "async lookups depth " + to_string(queueDepth);
+        vector<int> keys(2000);
+        for (int& key : keys) {
+            key = (int)(rng() % 8020) - 10;
+        }
+        vector<int> found(keys.size(), -2);
+        {
+            AsyncLookups<> lookups(&handler, queueDepth);
+            vector<AsyncLookups<>::Result> results;
+            for (size_t i = 0; i < keys.size(); i++) {
+                if (i % 3 == 0) {
+                    auto done = [&found, i](const int&, int address) { found[i] = address; };
+                    while (!lookups.submit(keys[i], done)) {
+                        lookups.poll(results, true);
+                    }
+                } else {
+                    while (!lookups.submit(keys[i], (uint64_t)i)) {
+                        lookups.poll(results, true);
+                    }
+                }
+            }
+            lookups.drain();
+            lookups.poll(results, false);
+            for (const AsyncLookups<>::Result& result : results) {
+                expect(result.key == keys[result.tag], what + ": result for another key");
+                found[result.tag] = result.address;
+            }
+        }
+        int differing = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            auto it = reference.find(keys[i]);
+            int expected = it == reference.end() ? -1 : it->second;
+            if (found[i] != expected || found[i] != index.SearchARecord(filename, keys[i])) {
+                differing++;
+            }
+        }
+        expect(differing == 0, what + ": " + to_string(differing) +
+                                   " lookups differ from SearchARecord");
+    }
+    removeIndexFile(filename);
+}
+
+// The int node search gives std::lower_bound's index for node sizes on
+// either side of each vector width, for keys before, between, on and past
+// the node's keys; every kernel this CPU runs is checked
+static void checkNodeLowerBound() {
+    mt19937 rng(9);
+    for (int count = 0; count <= 40; count++) {
+        for (int trial = 0; trial < 20; trial++) {
+            vector<int> sorted(count);
+            for (int& key : sorted) {
+                key = (int)(rng() % 200) - 100;
+            }
+            if (trial == 0 && count > 0) {
+                sorted.front() = INT_MIN;
+                sorted.back() = INT_MAX;
+            }
+            sort(sorted.begin(), sorted.end());
+            sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+            int n = sorted.size();
+            // Interleaved with addresses like a node's entries, and no
+            // bigger, so a read past the end shows under a sanitizer
+            vector<int> entries(2 * n);
+            for (int i = 0; i < n; i++) {
+                entries[2 * i] = sorted[i];
+                entries[2 * i + 1] = ~sorted[i];
+            }
+
+            vector<int> probes = {INT_MIN, INT_MAX, -101, 101};
+            for (int key : sorted) {
+                probes.push_back(key);
+                if (key != INT_MIN) {
+                    probes.push_back(key - 1);
+                }
+                if (key != INT_MAX) {
+                    probes.push_back(key + 1);
+                }
+            }
+            for (int key : probes) {
+                int expected = lower_bound(sorted.begin(), sorted.end(), key) - sorted.begin();
+                string what = "node lower bound n=" + to_string(n) + " key " + to_string(key);
+                expect(nodeLowerBoundInt32(entries.data(), n, key) == expected, what);
+                expect(nodeLowerBoundScalar(entries.data(), 0, n, key) == expected,
+                       what + " (scalar)");
+#ifdef NODE_SEARCH_X86
+                expect(nodeLowerBoundSSE2(entries.data(), n, key) == expected,
+                       what + " (SSE2)");
+                if (cpuHasAVX2()) {
+                    expect(nodeLowerBoundAVX2(entries.data(), n, key) == expected,
+                           what + " (AVX2)");
+                }
+#endif
+            }
+        }
+    }
+}
+
+// Keys of the typed checks: spread over the whole uint64_t range, and
+// strings with a common prefix so that they differ late
+static void makeKey(uint64_t n, uint64_t& key) {
+    key = n * 0x9E3779B97F4A7C15ull;
+}
+
+static void makeKey(uint64_t n, FixedKey<16>& key) {
+    key = FixedKey<16>("key-" + to_string(n * 7919 % 1000000000));
+}
+
+// Inserts, searches and deletes on an index of another key type, with
+// addresses past 32 bits, against a std::map
+template <class Key>
+static void checkTypedIndex(const string& name) {
+    typedef uint64_t Value;
+    char filename[] = "test_check.bin";
+    for (int m : {3, 4, 16}) {
+        string what = name + " index m=" + to_string(m);
+        IndexFileHandler<Key, Value> handler;
+        handler.createIndexFile(filename, 16, m);
+        BTreeAddition<Key, Value> btree(filename);
+        Index<Key, Value> index(&handler);
+        map<Key, Value> reference;
+        mt19937_64 rng(m);
+
+        for (int op = 0; op < 6000; op++) {
+            Key key;
+            makeKey(rng() % 3000, key);
+            if (reference.count(key)) {
+                if (op % 3 != 0) {
+                    index.DeleteARecord(filename, key);
+                    reference.erase(key);
+                }
+            } else {
+                Value address = ((Value)1 << 40) + op;
+                btree.addRecord(key, address);
+                reference[key] = address;
+            }
+        }
+
+        int differing = 0;
+        for (uint64_t n = 0; n < 3000; n++) {
+            Key key;
+            makeKey(n, key);
+            auto it = reference.find(key);
+            Value expected = it == reference.end() ? (Value)-1 : it->second;
+            if (index.SearchARecord(filename, key) != expected) {
+                differing++;
+            }
+        }
+        expect(differing == 0, what + ": " + to_string(differing) +
+                                   " searches differ from the reference");
+        vector<pair<Key, Value>> all =
+            index.SearchRange(filename, reference.begin()->first, reference.rbegin()->first);
+        expect(all == vector<pair<Key, Value>>(reference.begin(), reference.end()),
+               what + ": range scan differs from the reference");
+        expect(handler.getKeyCount() == (long long)reference.size(), what + ": key count");
+
+        while (!reference.empty()) {
+            index.DeleteARecord(filename, reference.begin()->first);
+            reference.erase(reference.begin());
+        }
+        Key key;
+        makeKey(1, key);
+        expect(index.SearchARecord(filename, key) == (Value)-1, what + ": search when empty");
+        expect(handler.getKeyCount() == 0, what + ": key count when empty");
+        removeIndexFile(filename);
+    }
+}
+
+// Calls naming another file than the handler's throw and change nothing
+static void checkFileNames() {
+    char filename[] = "test_check.bin";
+    char otherFilename[] = "test_other.bin";
+    IndexFileHandler handler;
+    handler.createIndexFile(filename, 16, 4);
+    BTreeAddition btree(filename);
+    Index index(&handler);
+    map<int, int> reference;
+    for (int key = 0; key < 50; key++) {
+        btree.addRecord(key, key + 1);
+        reference[key] = key + 1;
+    }
+
+    bool threw = false;
+    try {
+        index.SearchRange(otherFilename, INT_MIN, INT_MAX);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    expect(threw, "SearchRange on another file");
+    threw = false;
+    try {
+        index.DeleteRange(otherFilename, INT_MIN, INT_MAX);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    expect(threw, "DeleteRange on another file");
+    threw = false;
+    try {
+        index.DeleteMany(otherFilename, {1, 2, 3});
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    expect(threw, "DeleteMany on another file");
+    threw = false;
+    try {
+        index.SearchMany(otherFilename, {1, 2, 3});
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    expect(threw, "SearchMany on another file");
+    verify(handler, index, filename, reference, "file names");
+    removeIndexFile(filename);
+}
+
+static int runChecks() {
+    checkDeletesAtOrder3();
+    checkBulkLoad();
+    checkBulkDeletes();
+    checkLogReplay();
+    checkShadowReopen();
+    checkTombstoneCompaction();
+    checkLegacyConversion();
+    checkFileNames();
+    checkSearchMany();
+    checkAsyncLookups();
+    checkNodeLowerBound();
+    checkTypedIndex<uint64_t>("uint64_t");
+    checkTypedIndex<FixedKey<16>>("FixedKey<16>");
+    cout << (failures == 0 ? "All checks passed" : "Checks failed") << endl;
+    return failures == 0 ? 0 : 1;
+}
 
 void clearInputBuffer() {
     cin.clear();
@@ -19,7 +821,11 @@ void displayMenu() {
     cout << "Enter your choice: ";
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--check") {
+        return runChecks();
+    }
+
     IndexFileHandler handler;
     const char* filename = "indexfile.bin";
     int numberOfRecords, m;